@@ -0,0 +1,78 @@
+#
+# Local DNS stand-in for DnsResolver. Answers A queries from a small table with
+# a fixed TTL, returns NXDOMAIN (with an SOA carrying the negative TTL) for
+# everything else, and can delay or drop answers so several instances can race.
+#
+# Usage: python3 dns_standin.py [-p 5353] [-t 30] [-n 10] [-d 0] [-l 0] [-s] name=ip ...
+#   -t  TTL of positive answers, seconds
+#   -n  negative TTL (SOA MINIMUM) of NXDOMAIN answers, seconds
+#   -d  delay every answer by this many ms
+#   -l  drop this percentage of queries
+#   -s  answer SERVFAIL to everything
+#
+import getopt, random, socket, struct, sys, time
+
+
+opts, args = getopt.getopt(sys.argv[1:], "p:t:n:d:l:s")
+arxx = dict(opts)
+
+port = int(arxx.get("-p", 5353))
+ttl = int(arxx.get("-t", 30))
+negativeTtl = int(arxx.get("-n", 10))
+delay = int(arxx.get("-d", 0)) / 1000.0
+loss = int(arxx.get("-l", 0))
+servfail = "-s" in arxx
+
+records = {}                                                      # name -> packed IPv4
+for arg in args:
+    name, ip = arg.split("=")
+    records[name.lower().rstrip(".")] = socket.inet_aton(ip)
+
+
+def readQuestion(packet):
+    pos = 12
+    labels = []
+    while packet[pos] != 0:
+        length = packet[pos]
+        labels.append(packet[pos + 1:pos + 1 + length].decode("ascii", "replace"))
+        pos += 1 + length
+    qtype, qclass = struct.unpack(">HH", packet[pos + 1:pos + 5])
+    return ".".join(labels), qtype, packet[12:pos + 5]
+
+
+def answer(packet):
+    ident, flags, qdcount = struct.unpack(">HHH", packet[:6])
+    name, qtype, question = readQuestion(packet)
+    rd = flags & 0x0100
+
+    if servfail:
+        return struct.pack(">HHHHHH", ident, 0x8082 | rd, 1, 0, 0, 0) + question, "SERVFAIL"
+
+    address = records.get(name.lower())
+    if address is not None and qtype == 1:
+        record = struct.pack(">HHHIH", 0xC00C, 1, 1, ttl, 4) + address      # Name points at the question
+        return struct.pack(">HHHHHH", ident, 0x8480 | rd, 1, 1, 0, 0) + question + record, socket.inet_ntoa(address)
+
+    # NXDOMAIN, or NODATA for a known name asked for another type
+    rcode = 0 if address is not None else 3
+    soa = b"\x02ns\xc0\x0c" + b"\x0ahostmaster\xc0\x0c" + struct.pack(">IIIII", 1, 3600, 600, 86400, negativeTtl)
+    record = struct.pack(">HHHIH", 0xC00C, 6, 1, negativeTtl, len(soa)) + soa
+    return struct.pack(">HHHHHH", ident, 0x8480 | rd | rcode, 1, 0, 1, 0) + question + record, "NXDOMAIN" if rcode else "NODATA"
+
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.bind(("0.0.0.0", port))
+print("DNS stand-in on port %d: %d names, TTL %d s, negative TTL %d s" % (port, len(records), ttl, negativeTtl))
+
+while True:
+    packet, peer = sock.recvfrom(512)
+    if len(packet) < 17:
+        continue
+    if loss and random.randint(1, 100) <= loss:
+        print("%s: dropped" % peer[0])
+        continue
+    response, summary = answer(packet)
+    if delay:
+        time.sleep(delay)
+    sock.sendto(response, peer)
+    print("%s: %s -> %s" % (peer[0], readQuestion(packet)[0], summary))
@@ -1,15 +1,35 @@
+import os
+
 Import("env")
 
 APP_BIN = "$BUILD_DIR/${PROGNAME}.bin"
 MERGED_BIN = "$BUILD_DIR/${PROGNAME}_merged.bin"
 BOARD_CONFIG = env.BoardConfig()
 
+# Optional per-device provisioning image (see provision.py), flashed into the
+# "prov" partition. Defaults to provision.bin in the project directory.
+PROVISION_BIN = os.environ.get("PROVISION_BIN", os.path.join(env.subst("$PROJECT_DIR"), "provision.bin"))
+
+
+def provision_offset():
+    with open(os.path.join(env.subst("$PROJECT_DIR"), "partitions.csv")) as table:
+        for line in table:
+            fields = [f.strip() for f in line.split("#")[0].split(",")]
+            if fields[0] == "prov":
+                return fields[3]
+    return None
+
 
 def merge_bin(source, target, env):
     # The list contains all extra images (bootloader, partitions, eboot) and
     # the final application binary
     flash_images = env.Flatten(env.get("FLASH_EXTRA_IMAGES", [])) + ["$ESP32_APP_OFFSET", APP_BIN]
 
+    offset = provision_offset()
+    if offset and os.path.isfile(PROVISION_BIN):
+        print("Adding provisioning image %s at %s" % (PROVISION_BIN, offset))
+        flash_images += [offset, PROVISION_BIN]
+
     # Run esptool to merge images into a single binary
     env.Execute(
         " ".join(
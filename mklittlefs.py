@@ -24,7 +24,7 @@ dataPath = arxx["-c"]
 
 fileList = [pth for pth in Path(dataPath).iterdir() if pth.stem[0] != '.']          # Create a list of all the files in the directory
 
-fs = LittleFS(block_size=4096, block_count=3072)                                    # Open LittleFS, create a 12MB partition
+fs = LittleFS(block_size=4096, block_count=0x17F000 // 4096)                        # Open LittleFS, sized to the spiffs partition in partitions.csv
 
 for curFile in fileList:
     print( "Adding " + curFile.name )
@@ -0,0 +1,71 @@
+#
+# Local HTTP stand-in for OtaUpdater. Serves one firmware image with support
+# for Range requests, and can throttle or drop connections to exercise
+# resumed downloads.
+#
+# Usage: python3 ota_server.py -f .pio/build/esp-wrover-kit/firmware.bin [-p 8080] [-r 200] [-d 300000]
+#   -r  throttle to this many KB/s (0 = unlimited)
+#   -d  drop the connection after this many bytes of each response (0 = never)
+#
+import getopt, hashlib, os, sys, time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+opts, _ = getopt.getopt(sys.argv[1:], "f:p:r:d:")
+arxx = dict(opts)
+
+imagePath = arxx["-f"]
+port = int(arxx.get("-p", 8080))
+rateLimit = int(arxx.get("-r", 0)) * 1024
+dropAfter = int(arxx.get("-d", 0))
+
+with open(imagePath, "rb") as f:
+    image = f.read()
+
+print("Serving %s (%d bytes) on port %d" % (imagePath, len(image), port))
+print("sha256: " + hashlib.sha256(image).hexdigest())
+
+
+class OtaHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        start = 0
+        rangeHeader = self.headers.get("Range")
+        if rangeHeader and rangeHeader.startswith("bytes="):
+            start = int(rangeHeader[6:].split("-")[0])
+            if start >= len(image):
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(image))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+
+        body = image[start:]
+        if rangeHeader:
+            self.send_response(206)
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, len(image) - 1, len(image)))
+        else:
+            self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Connection", "close")
+        self.end_headers()
+
+        began = time.time()
+        sent = 0
+        for offset in range(0, len(body), 1460):
+            chunk = body[offset:offset + 1460]
+            if dropAfter and sent + len(chunk) > dropAfter:
+                print("Dropping connection at offset %d" % (start + sent))
+                return                                                              # Closing early simulates a lost uplink
+            self.wfile.write(chunk)
+            sent += len(chunk)
+            if rateLimit:
+                time.sleep(max(0, sent / rateLimit - (time.time() - began)))
+
+        elapsed = time.time() - began
+        print("Sent %d bytes from offset %d in %.2f s (%.1f KB/s)" % (sent, start, elapsed, sent / 1024 / max(elapsed, 1e-6)))
+
+
+ThreadingHTTPServer(("", port), OtaHandler).serve_forever()
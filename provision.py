@@ -0,0 +1,189 @@
+#
+# Generates and validates per-device provisioning images for the "prov" data
+# partition read by NetworkManager::loadProvisioning(). The layout must match
+# struct ProvisioningImage in src/esp32_netmanager.h.
+#
+# Usage:
+#   python3 provision.py generate -i devices.csv -o out/        one <serial>.bin per row
+#   python3 provision.py validate out/*.bin                     check magic, version, size and CRC
+#   python3 provision.py stamp -m firmware_merged.bin -i devices.csv -o out/
+#                                                               one merged image per row, flashable at 0x0
+#
+# devices.csv columns (empty address fields mean DHCP, empty ap_ssid keeps the firmware default):
+#   serial, eth_mac, wifi1_ssid, wifi1_password, wifi1_auth_mode, wifi2_ssid, wifi2_password, wifi2_auth_mode,
+#   wifi_ip, wifi_gateway, wifi_subnet, wifi_dns, eth_ip, eth_gateway, eth_subnet, eth_dns,
+#   ap_ssid, ap_password, ap_auth_mode, ap_channel, ap_max_connections, ap_hidden
+#
+# *_auth_mode takes a wifi_auth_mode_t name without the WIFI_AUTH_ prefix (OPEN, WPA2_PSK,
+# WPA2_WPA3_PSK, ...) or its number. Empty means WPA2_PSK with a password, OPEN without.
+#
+import csv, getopt, ipaddress, struct, sys, zlib
+from pathlib import Path
+
+
+MAGIC = 0x56504D4E                                                                  # "NMPV"
+VERSION = 1
+PARTITION_NAME = "prov"
+
+HAS_ETH_MAC = 1 << 0
+WIFI_STATIC_IP = 1 << 1
+ETH_STATIC_IP = 1 << 2
+HAS_SOFTAP = 1 << 3
+
+AUTH_MODES = {                                                                      # wifi_auth_mode_t, ESP-IDF 4.4
+    "OPEN": 0, "WEP": 1, "WPA_PSK": 2, "WPA2_PSK": 3, "WPA_WPA2_PSK": 4,
+    "WPA2_ENTERPRISE": 5, "WPA3_PSK": 6, "WPA2_WPA3_PSK": 7, "WAPI_PSK": 8
+}
+
+HEADER = struct.Struct("<IHHI")                                                     # magic, version, size, crc32
+BODY = struct.Struct("<I32s6s2x" + "32s64sB3x" * 2 + "4s4s4s4s" * 2 + "32s64sBBBB")
+IMAGE_SIZE = HEADER.size + BODY.size
+assert IMAGE_SIZE == 388
+
+
+def text(value, size):
+    data = value.encode("utf-8")
+    if len(data) >= size:
+        raise ValueError("'%s' is longer than %d bytes" % (value, size - 1))       # Keep room for the terminator
+    return data
+
+
+def address(value):
+    return ipaddress.IPv4Address(value).packed if value else bytes(4)
+
+
+def authMode(value, password):
+    if not value:
+        return AUTH_MODES["WPA2_PSK"] if password else AUTH_MODES["OPEN"]
+    name = value.strip().upper()
+    if name.startswith("WIFI_AUTH_"):
+        name = name[len("WIFI_AUTH_"):]
+    mode = AUTH_MODES[name] if name in AUTH_MODES else int(name, 0)
+    if mode not in AUTH_MODES.values():
+        raise ValueError("unknown auth mode " + value)
+    if (mode == AUTH_MODES["OPEN"]) != (not password):
+        raise ValueError("auth mode %s does not match %s password" % (value, "a" if password else "an empty"))
+    return mode
+
+
+def build(row):
+    flags = 0
+
+    mac = bytes(6)
+    if row.get("eth_mac"):
+        mac = bytes.fromhex(row["eth_mac"].replace(":", "").replace("-", ""))
+        if len(mac) != 6:
+            raise ValueError("bad MAC address " + row["eth_mac"])
+        flags |= HAS_ETH_MAC
+
+    credentials = []
+    for n in (1, 2):
+        password = row.get("wifi%d_password" % n, "")
+        credentials += [text(row.get("wifi%d_ssid" % n, ""), 32), text(password, 64),
+                        authMode(row.get("wifi%d_auth_mode" % n), password)]
+
+    addressing = []
+    for prefix, flag in (("wifi", WIFI_STATIC_IP), ("eth", ETH_STATIC_IP)):
+        if row.get(prefix + "_ip"):
+            flags |= flag
+        addressing += [address(row.get(prefix + "_ip")), address(row.get(prefix + "_gateway")),
+                       address(row.get(prefix + "_subnet") or ("255.255.255.0" if row.get(prefix + "_ip") else "")),
+                       address(row.get(prefix + "_dns"))]
+
+    apPassword = row.get("ap_password", "")
+    if row.get("ap_ssid"):
+        flags |= HAS_SOFTAP
+        if apPassword and len(apPassword) < 8:
+            raise ValueError("AP password must be at least 8 characters")
+    softAP = [text(row.get("ap_ssid", ""), 32), text(apPassword, 64), int(row.get("ap_channel") or 1),
+              authMode(row.get("ap_auth_mode"), apPassword),
+              int(row.get("ap_max_connections") or 4), int(row.get("ap_hidden") or 0)]
+
+    body = BODY.pack(flags, text(row["serial"], 32), mac, *credentials, *addressing, *softAP)
+    return HEADER.pack(MAGIC, VERSION, IMAGE_SIZE, zlib.crc32(body)) + body
+
+
+def check(data):
+    if len(data) < IMAGE_SIZE:
+        return "too short"
+    magic, version, size, crc = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        return "bad magic"
+    if version != VERSION:
+        return "unsupported version %d" % version
+    if size != IMAGE_SIZE:
+        return "bad size %d" % size
+    if zlib.crc32(data[HEADER.size:IMAGE_SIZE]) != crc:
+        return "CRC mismatch"
+    return None
+
+
+def partitionOffset(table="partitions.csv"):
+    for line in open(Path(__file__).parent / table):
+        fields = [f.strip() for f in line.split("#")[0].split(",")]
+        if fields[0] == PARTITION_NAME:
+            return int(fields[3], 0), int(fields[4], 0)
+    raise SystemExit("No '%s' partition in %s" % (PARTITION_NAME, table))
+
+
+def rows(path):
+    with open(path, newline="") as f:
+        yield from csv.DictReader(f)
+
+
+def generate(arxx):
+    outDir = Path(arxx["-o"])
+    outDir.mkdir(parents=True, exist_ok=True)
+    count = 0
+    for row in rows(arxx["-i"]):
+        (outDir / (row["serial"] + ".bin")).write_bytes(build(row))
+        count += 1
+    print("Generated %d provisioning images in %s" % (count, outDir))
+
+
+def validate(files):
+    failed = 0
+    for name in files:
+        data = Path(name).read_bytes()
+        error = check(data)
+        if error:
+            failed += 1
+            print("%s: %s" % (name, error))
+        else:
+            serial = BODY.unpack_from(data, HEADER.size)[1].rstrip(b"\0").decode()
+            print("%s: ok (serial %s)" % (name, serial))
+    return failed
+
+
+def stamp(arxx):
+    offset, size = partitionOffset()
+    merged = Path(arxx["-m"]).read_bytes()
+    if len(merged) < offset + size:
+        raise SystemExit("%s does not cover the '%s' partition at 0x%X" % (arxx["-m"], PARTITION_NAME, offset))
+
+    outDir = Path(arxx["-o"])
+    outDir.mkdir(parents=True, exist_ok=True)
+    count = 0
+    for row in rows(arxx["-i"]):
+        blob = build(row).ljust(size, b"\xff")                                      # Rest of the sector stays erased
+        (outDir / (row["serial"] + "_merged.bin")).write_bytes(merged[:offset] + blob + merged[offset + size:])
+        count += 1
+    print("Stamped %d images at 0x%X" % (count, offset))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        raise SystemExit("usage: provision.py generate|validate|stamp ...")
+
+    command = sys.argv[1]
+    opts, args = getopt.getopt(sys.argv[2:], "i:o:m:")
+    arxx = dict(opts)
+
+    if command == "generate":
+        generate(arxx)
+    elif command == "validate":
+        sys.exit(1 if validate(args) else 0)
+    elif command == "stamp":
+        stamp(arxx)
+    else:
+        raise SystemExit("unknown command " + command)
@@ -1,8 +1,40 @@
 #include <esp_wifi.h>
+#include <esp_netif.h>
 #include <WiFi.h>
 #include <SPI.h>
 #include <Ethernet.h>
 #include <DNSServer.h>
+#include <ArduinoJson.h>
+#include <Preferences.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <mbedtls/sha256.h>
+#include <atomic>
+
+// Block size and count of the buffer pool used by the transport clients
+#ifndef NETMANAGER_POOL_BLOCK_SIZE
+#define NETMANAGER_POOL_BLOCK_SIZE 512
+#endif
+
+#ifndef NETMANAGER_POOL_BLOCKS
+#define NETMANAGER_POOL_BLOCKS 16
+#endif
+
+// Size of the fixed arena backing status JSON documents
+#ifndef NETMANAGER_STATUS_JSON_ARENA
+#define NETMANAGER_STATUS_JSON_ARENA 4096
+#endif
+
+// Events kept by the NetworkManager trace recorder (power of two)
+#ifndef NETMANAGER_TRACE_EVENTS
+#define NETMANAGER_TRACE_EVENTS 256
+#endif
+
+// Number of names kept by DnsResolver
+#ifndef NETMANAGER_DNS_CACHE_SIZE
+#define NETMANAGER_DNS_CACHE_SIZE 16
+#endif
 
 // Network configuration class
 class NetworkConfig {
@@ -52,12 +84,50 @@ class SoftAPConfig {
   }
 };
 
+// Scan Configuration (mirrors wifi_scan_config_t)
+class ScanConfig {
+  public: static
+  const int MAX_CHANNELS = 14;
+
+  uint8_t channels[MAX_CHANNELS]; // Channels to visit, in order
+  uint8_t channelCount; // 0 = all channels
+  bool passive; // Listen for beacons instead of sending probe requests
+  uint32_t minDwellMs; // Active scan: minimum time per channel
+  uint32_t maxDwellMs; // Active scan: maximum time per channel, passive: time per channel
+  char ssid[33]; // Only report this SSID (empty = any)
+  uint8_t bssid[6]; // Only report this BSSID (when filterBssid is set)
+  bool filterBssid;
+  bool showHidden;
+  int32_t minRSSI;
+
+  ScanConfig(): channelCount(0),
+  passive(false),
+  minDwellMs(0),
+  maxDwellMs(120),
+  filterBssid(false),
+  showHidden(false),
+  minRSSI(-100) {
+    ssid[0] = '\0';
+    memset(bssid, 0, sizeof(bssid));
+  }
+
+  bool addChannel(uint8_t channel) {
+    if (channel < 1 || channel > MAX_CHANNELS || channelCount >= MAX_CHANNELS) {
+      return false;
+    }
+    channels[channelCount++] = channel;
+    return true;
+  }
+};
+
 // WiFi Network Information Structure
 struct WiFiNetwork {
   char ssid[33];
   int32_t rssi;
   wifi_auth_mode_t authMode;
   bool isHidden;
+  uint8_t bssid[6];
+  uint8_t channel;
 };
 
 struct ScanResult {
@@ -65,13 +135,703 @@ struct ScanResult {
   int count; // Number of valid networks found
 };
 
+// Factory provisioning image. provision.py writes one per device into the
+// "prov" data partition; NetworkManager::loadProvisioning() maps it straight
+// from flash, so the layout is fixed and little-endian. Bump VERSION on any
+// layout change and keep provision.py in step.
+struct __attribute__((packed)) ProvisioningImage {
+  static
+  const uint32_t MAGIC = 0x56504D4E; // "NMPV"
+  static
+  const uint16_t VERSION = 1;
+  static
+  const uint8_t PARTITION_SUBTYPE = 0x40;
+
+  enum Flags: uint32_t {
+    HAS_ETH_MAC = 1 << 0,
+    WIFI_STATIC_IP = 1 << 1,
+    ETH_STATIC_IP = 1 << 2,
+    HAS_SOFTAP = 1 << 3
+  };
+
+  struct Credential {
+    char ssid[32];
+    char password[64];
+    uint8_t authMode;
+    uint8_t reserved[3];
+  };
+
+  struct Addressing {
+    uint8_t ip[4];
+    uint8_t gateway[4];
+    uint8_t subnet[4];
+    uint8_t dns[4];
+  };
+
+  struct SoftAP {
+    char ssid[32];
+    char password[64];
+    uint8_t channel;
+    uint8_t authMode;
+    uint8_t maxConnections;
+    uint8_t hidden;
+  };
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size; // sizeof(ProvisioningImage)
+  uint32_t crc32; // CRC-32 (zlib) of the bytes after this field
+  uint32_t flags;
+  char serial[32];
+  uint8_t ethMac[6];
+  uint8_t reserved[2];
+  Credential wifi[2];
+  Addressing wifiAddress;
+  Addressing ethAddress;
+  SoftAP softAP;
+};
+
+static_assert(sizeof(ProvisioningImage) == 388, "ProvisioningImage layout must match provision.py");
+
+// SoftAP client record
+struct SoftAPClient {
+  uint8_t mac[6];
+  uint32_t ipAddress; // 0 until DHCP has assigned one
+  unsigned long associatedAt;
+  unsigned long lastActivity;
+  int8_t rssi;
+  uint32_t bytesServed;
+  uint32_t queriesServed;
+
+  IPAddress ip() const {
+    return IPAddress(ipAddress);
+  }
+};
+
+// Fixed-capacity, open-addressed table of SoftAP clients keyed by MAC.
+// Only the task calling NetworkManager::update() writes to it; every slot is
+// guarded by a sequence counter so other tasks can read it without locking.
+class SoftAPClientTable {
+  public: static
+  const int CAPACITY = 16; // Power of two; the SoftAP's maximum of 10 stations keeps load under 2/3
+
+  SoftAPClientTable(): count(0) {
+    memset(slots, 0, sizeof(slots));
+  }
+
+  // Lookup by MAC, expected O(1)
+  bool find(const uint8_t * mac, SoftAPClient & client) const {
+    uint32_t index = hashMac(mac);
+    for (int probe = 0; probe < CAPACITY; probe++) {
+      uint8_t state = readSlot((index + probe) & (CAPACITY - 1), client);
+      if (state == SLOT_EMPTY) return false;
+      if (state == SLOT_USED && memcmp(client.mac, mac, 6) == 0) return true;
+    }
+    return false;
+  }
+
+  bool findByIP(const IPAddress & ip, SoftAPClient & client) const {
+    for (int i = 0; i < CAPACITY; i++) {
+      if (readSlot(i, client) == SLOT_USED && client.ipAddress == (uint32_t) ip) return true;
+    }
+    return false;
+  }
+
+  // Copies up to max clients into out, returns the number copied
+  int snapshot(SoftAPClient * out, int max) const {
+    int copied = 0;
+    for (int i = 0; i < CAPACITY && copied < max; i++) {
+      if (readSlot(i, out[copied]) == SLOT_USED) copied++;
+    }
+    return copied;
+  }
+
+  int size() const {
+    return count;
+  }
+
+  // Writer side, called from NetworkManager::update() only
+
+  SoftAPClient * insert(const uint8_t * mac, unsigned long now) {
+    uint32_t index = hashMac(mac);
+    int target = -1;
+
+    for (int probe = 0; probe < CAPACITY; probe++) {
+      int i = (index + probe) & (CAPACITY - 1);
+      if (slots[i].state == SLOT_USED) {
+        if (memcmp(slots[i].client.mac, mac, 6) == 0) return & slots[i].client;
+        continue;
+      }
+      if (target < 0) target = i; // First empty or deleted slot
+      if (slots[i].state == SLOT_EMPTY) break;
+    }
+    if (target < 0) return nullptr; // Table full
+
+    beginWrite(target);
+    Slot & slot = slots[target];
+    memset( & slot.client, 0, sizeof(slot.client));
+    memcpy(slot.client.mac, mac, 6);
+    slot.client.associatedAt = now;
+    slot.client.lastActivity = now;
+    slot.state = SLOT_USED;
+    endWrite(target);
+
+    count++;
+    return & slot.client;
+  }
+
+  bool remove(const uint8_t * mac) {
+    int i = locate(mac);
+    if (i < 0) return false;
+
+    beginWrite(i);
+    slots[i].state = SLOT_DELETED;
+    endWrite(i);
+
+    // A tombstone followed by an empty slot ends no probe chain: clear it and
+    // any tombstones run up behind it
+    int j = i;
+    while (slots[j].state == SLOT_DELETED && slots[(j + 1) & (CAPACITY - 1)].state == SLOT_EMPTY) {
+      beginWrite(j);
+      slots[j].state = SLOT_EMPTY;
+      endWrite(j);
+      j = (j - 1) & (CAPACITY - 1);
+    }
+
+    if (--count == 0) {
+      // Nothing live left: drop the tombstones so probes stay short
+      for (int j = 0; j < CAPACITY; j++) {
+        beginWrite(j);
+        slots[j].state = SLOT_EMPTY;
+        endWrite(j);
+      }
+    }
+    return true;
+  }
+
+  // Update one client in place; the function runs inside the slot's write section
+  template < typename Fn >
+    bool modify(const uint8_t * mac, Fn fn) {
+      int i = locate(mac);
+      if (i < 0) return false;
+
+      beginWrite(i);
+      fn(slots[i].client);
+      endWrite(i);
+      return true;
+    }
+
+  template < typename Fn >
+    bool modifyByIP(uint32_t ip, Fn fn) {
+      for (int i = 0; i < CAPACITY; i++) {
+        if (slots[i].state == SLOT_USED && slots[i].client.ipAddress == ip) {
+          beginWrite(i);
+          fn(slots[i].client);
+          endWrite(i);
+          return true;
+        }
+      }
+      return false;
+    }
+
+  // Writer-side iteration without sequence checks
+  template < typename Fn >
+    void forEach(Fn fn) const {
+      for (int i = 0; i < CAPACITY; i++) {
+        if (slots[i].state == SLOT_USED) fn(slots[i].client);
+      }
+    }
+
+  private: enum SlotState: uint8_t {
+    SLOT_EMPTY,
+    SLOT_USED,
+    SLOT_DELETED
+  };
+
+  struct Slot {
+    uint32_t sequence; // Odd while a write is in progress
+    uint8_t state;
+    SoftAPClient client;
+  };
+
+  Slot slots[CAPACITY];
+  int count;
+
+  static uint32_t hashMac(const uint8_t * mac) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < 6; i++) {
+      hash = (hash ^ mac[i]) * 16777619u;
+    }
+    return hash;
+  }
+
+  int locate(const uint8_t * mac) const {
+    uint32_t index = hashMac(mac);
+    for (int probe = 0; probe < CAPACITY; probe++) {
+      int i = (index + probe) & (CAPACITY - 1);
+      if (slots[i].state == SLOT_EMPTY) return -1;
+      if (slots[i].state == SLOT_USED && memcmp(slots[i].client.mac, mac, 6) == 0) return i;
+    }
+    return -1;
+  }
+
+  void beginWrite(int i) {
+    __atomic_store_n( & slots[i].sequence, slots[i].sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+  void endWrite(int i) {
+    __atomic_store_n( & slots[i].sequence, slots[i].sequence + 1, __ATOMIC_RELEASE);
+  }
+
+  // Consistent copy of one slot, retried while the writer is inside it
+  uint8_t readSlot(int i, SoftAPClient & client) const {
+    const Slot & slot = slots[i];
+    uint32_t before, after;
+    uint8_t state;
+
+    do {
+      before = __atomic_load_n( & slot.sequence, __ATOMIC_ACQUIRE);
+      state = slot.state;
+      memcpy( & client, & slot.client, sizeof(client));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n( & slot.sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) != 0 || before != after);
+
+    return state;
+  }
+};
+
+// ArduinoJson allocator serving a fixed, caller-owned buffer, so status
+// documents never touch the heap. Blocks are bump-allocated; the last block
+// can grow or shrink in place, which covers how JsonDocument grows its pools.
+class StaticJsonArena: public ArduinoJson::Allocator {
+  public: StaticJsonArena(uint8_t * buffer, size_t capacity): buffer(buffer),
+  capacity(capacity),
+  used(0),
+  last(0),
+  peak(0) {}
+
+  void * allocate(size_t size) override {
+    size_t offset = used;
+    size_t need = HEADER + align(size);
+    if (offset + need > capacity) return nullptr;
+
+    * reinterpret_cast < size_t * > (buffer + offset) = size;
+    last = offset;
+    used = offset + need;
+    if (used > peak) peak = used;
+    return buffer + offset + HEADER;
+  }
+
+  void deallocate(void * ptr) override {
+    if (ptr != nullptr && blockOffset(ptr) == last) {
+      used = last; // Only the most recent block can be returned
+    }
+  }
+
+  void * reallocate(void * ptr, size_t size) override {
+    if (ptr == nullptr) return allocate(size);
+
+    size_t offset = blockOffset(ptr);
+    if (offset == last && offset + HEADER + align(size) <= capacity) {
+      * reinterpret_cast < size_t * > (buffer + offset) = size;
+      used = offset + HEADER + align(size);
+      if (used > peak) peak = used;
+      return ptr;
+    }
+
+    size_t oldSize = * reinterpret_cast < size_t * > (buffer + offset);
+    void * moved = allocate(size);
+    if (moved != nullptr) memcpy(moved, ptr, oldSize < size ? oldSize : size);
+    return moved;
+  }
+
+  void reset() {
+    used = 0;
+    last = 0;
+  }
+
+  size_t peakUsage() const {
+    return peak;
+  }
+
+  private: static
+  const size_t HEADER = sizeof(size_t) * 2; // Keeps blocks 8-byte aligned
+
+  uint8_t * buffer;
+  size_t capacity;
+  size_t used;
+  size_t last;
+  size_t peak;
+
+  static size_t align(size_t size) {
+    return (size + 7) & ~(size_t) 7;
+  }
+
+  size_t blockOffset(void * ptr) const {
+    return static_cast < uint8_t * > (ptr) - buffer - HEADER;
+  }
+};
+
+// Fixed-size block allocator for the transport clients. Blocks are chained
+// into per-client send queues, so buffering during a failover never touches
+// the heap. Safe to use from several tasks.
+class BufferPool {
+  public: static
+  const size_t BLOCK_SIZE = NETMANAGER_POOL_BLOCK_SIZE;
+  static
+  const int BLOCK_COUNT = NETMANAGER_POOL_BLOCKS;
+  static
+  const int16_t NONE = -1;
+
+  struct Block {
+    int16_t next;
+    uint16_t start; // First unread byte
+    uint16_t length; // One past the last written byte
+    uint8_t data[BLOCK_SIZE];
+  };
+
+  BufferPool(): freeHead(0),
+  freeCount(BLOCK_COUNT) {
+    for (int i = 0; i < BLOCK_COUNT; i++) {
+      blocks[i].next = i + 1 < BLOCK_COUNT ? i + 1 : NONE;
+    }
+  }
+
+  int16_t acquire() {
+    portENTER_CRITICAL( & lock);
+    int16_t index = freeHead;
+    if (index != NONE) {
+      freeHead = blocks[index].next;
+      freeCount--;
+    }
+    portEXIT_CRITICAL( & lock);
+
+    if (index != NONE) {
+      blocks[index].next = NONE;
+      blocks[index].start = 0;
+      blocks[index].length = 0;
+    }
+    return index;
+  }
+
+  void release(int16_t index) {
+    portENTER_CRITICAL( & lock);
+    blocks[index].next = freeHead;
+    freeHead = index;
+    freeCount++;
+    portEXIT_CRITICAL( & lock);
+  }
+
+  Block & operator[](int16_t index) {
+    return blocks[index];
+  }
+
+  int available() const {
+    return freeCount;
+  }
+
+  private: Block blocks[BLOCK_COUNT];
+  int16_t freeHead;
+  volatile int freeCount;
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+// FIFO of bytes stored in BufferPool blocks
+class BlockQueue {
+  public: BlockQueue(BufferPool & pool): pool(pool),
+  head(BufferPool::NONE),
+  tail(BufferPool::NONE),
+  bytes(0) {}
+
+  ~BlockQueue() {
+    clear();
+  }
+
+  // Appends up to limit total queued bytes; returns the number of bytes accepted
+  size_t push(const uint8_t * data, size_t size, size_t limit) {
+    size_t accepted = 0;
+
+    while (accepted < size && bytes < limit) {
+      if (tail == BufferPool::NONE || pool[tail].length == BufferPool::BLOCK_SIZE) {
+        int16_t block = pool.acquire();
+        if (block == BufferPool::NONE) break; // Pool exhausted
+
+        if (tail == BufferPool::NONE) {
+          head = block;
+        } else {
+          pool[tail].next = block;
+        }
+        tail = block;
+      }
+
+      BufferPool::Block & block = pool[tail];
+      size_t room = BufferPool::BLOCK_SIZE - block.length;
+      size_t chunk = size - accepted;
+      if (chunk > room) chunk = room;
+      if (chunk > limit - bytes) chunk = limit - bytes;
+
+      memcpy(block.data + block.length, data + accepted, chunk);
+      block.length += chunk;
+      accepted += chunk;
+      bytes += chunk;
+    }
+    return accepted;
+  }
+
+  // Appends all of data or, if the limit or the pool runs out, nothing
+  bool pushAll(const uint8_t * data, size_t size, size_t limit) {
+    size_t accepted = push(data, size, limit);
+    if (accepted == size) return true;
+    trim(accepted);
+    return false;
+  }
+
+  // Drops the last count bytes pushed
+  void trim(size_t count) {
+    while (count > 0 && tail != BufferPool::NONE) {
+      BufferPool::Block & block = pool[tail];
+      size_t chunk = block.length - block.start;
+      if (chunk > count) chunk = count;
+
+      block.length -= chunk;
+      bytes -= chunk;
+      count -= chunk;
+
+      if (block.length == block.start) {
+        int16_t previous = BufferPool::NONE;
+        for (int16_t i = head; i != tail; i = pool[i].next) previous = i;
+
+        pool.release(tail);
+        tail = previous;
+        if (previous == BufferPool::NONE) {
+          head = BufferPool::NONE;
+        } else {
+          pool[previous].next = BufferPool::NONE;
+        }
+      }
+    }
+  }
+
+  // Contiguous run at the front of the queue
+  const uint8_t * front(size_t & length) {
+    if (head == BufferPool::NONE) {
+      length = 0;
+      return nullptr;
+    }
+    length = pool[head].length - pool[head].start;
+    return pool[head].data + pool[head].start;
+  }
+
+  void consume(size_t count) {
+    while (count > 0 && head != BufferPool::NONE) {
+      BufferPool::Block & block = pool[head];
+      size_t chunk = block.length - block.start;
+      if (chunk > count) chunk = count;
+
+      block.start += chunk;
+      bytes -= chunk;
+      count -= chunk;
+
+      if (block.start == block.length) {
+        int16_t next = block.next;
+        pool.release(head);
+        head = next;
+        if (head == BufferPool::NONE) tail = BufferPool::NONE;
+      }
+    }
+  }
+
+  // Copies and consumes up to size bytes
+  size_t pop(uint8_t * out, size_t size) {
+    size_t copied = 0;
+    while (copied < size) {
+      size_t length;
+      const uint8_t * data = front(length);
+      if (data == nullptr) break;
+      if (length > size - copied) length = size - copied;
+      memcpy(out + copied, data, length);
+      consume(length);
+      copied += length;
+    }
+    return copied;
+  }
+
+  void clear() {
+    consume(bytes);
+  }
+
+  size_t size() const {
+    return bytes;
+  }
+
+  private: BufferPool & pool;
+  int16_t head;
+  int16_t tail;
+  size_t bytes;
+};
+
+// Fixed ring of timestamped begin/end/instant events, exported as Chrome trace
+// JSON (chrome://tracing, ui.perfetto.dev). Names must be string literals; an
+// event costs one atomic increment and a 12-byte store, from any task.
+class TraceRecorder {
+  public: static
+  const uint32_t CAPACITY = NETMANAGER_TRACE_EVENTS;
+  static_assert((CAPACITY & (CAPACITY - 1)) == 0, "NETMANAGER_TRACE_EVENTS must be a power of two");
+
+  enum Track {
+    TRACK_STATE = 1, // NetworkState transitions
+    TRACK_NETWORK, // Setup phases, DHCP and blocking waits
+    TRACK_SCAN,
+    TRACK_EVENTS, // WiFi events, failovers and interface changes
+    TRACK_COUNT
+  };
+
+  TraceRecorder(): head(0),
+  enabled(true) {
+    memset(events, 0, sizeof(events));
+  }
+
+  void begin(Track track, const char * name, int16_t value = -1) {
+    record('B', track, name, value);
+  }
+
+  void end(Track track, const char * name) {
+    record('E', track, name, -1);
+  }
+
+  void instant(Track track, const char * name, int16_t value = -1) {
+    record('i', track, name, value);
+  }
+
+  // Records a begin/end pair around its own lifetime
+  class Span {
+    public: Span(TraceRecorder & recorder, Track track, const char * name, int16_t value = -1): recorder(recorder),
+    track(track),
+    name(name) {
+      recorder.begin(track, name, value);
+    }
+
+    ~Span() {
+      recorder.end(track, name);
+    }
+
+    private: TraceRecorder & recorder;
+    Track track;
+    const char * name;
+  };
+
+  void setEnabled(bool enable) {
+    enabled = enable;
+  }
+
+  void clear() {
+    head = 0;
+  }
+
+  // Events currently held (older ones have been overwritten)
+  uint32_t size() {
+    uint32_t recorded = head.load();
+    return recorded < CAPACITY ? recorded : CAPACITY;
+  }
+
+  // Total events recorded, including overwritten ones
+  uint32_t recorded() {
+    return head.load();
+  }
+
+  // Streams the buffer as a Chrome trace JSON object. Recording is paused while
+  // writing; end events whose begin was overwritten are skipped.
+  void writeChromeTrace(Print & out) {
+    static const char * trackNames[TRACK_COUNT] = {
+      "",
+      "state",
+      "network",
+      "scan",
+      "events"
+    };
+
+    bool wasEnabled = enabled;
+    enabled = false;
+
+    uint32_t last = head.load();
+    uint32_t first = last > CAPACITY ? last - CAPACITY : 0;
+
+    out.print("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    out.print("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"NetworkManager\"}}");
+    for (int track = TRACK_STATE; track < TRACK_COUNT; track++) {
+      out.printf(",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+        track, trackNames[track]);
+    }
+
+    int depth[TRACK_COUNT] = {
+      0
+    };
+    uint64_t epoch = 0; // Added to micros() after each wrap
+    uint32_t previous = events[first % CAPACITY].timestamp;
+
+    for (uint32_t i = first; i < last; i++) {
+      Event event = events[i % CAPACITY];
+      if (event.name == nullptr || event.track >= TRACK_COUNT) continue;
+
+      if (event.phase == 'B') {
+        depth[event.track]++;
+      } else if (event.phase == 'E') {
+        if (depth[event.track] == 0) continue;
+        depth[event.track]--;
+      }
+
+      // Events from other tasks can land slightly out of order; only a large
+      // backwards step is a micros() wrap
+      if (event.timestamp < previous && previous - event.timestamp > 0x80000000u) {
+        epoch += 0x100000000ull;
+      }
+      previous = event.timestamp;
+
+      out.printf(",{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%u",
+        event.name, event.phase, (unsigned long long)(epoch + event.timestamp), event.track);
+      if (event.phase == 'i') out.print(",\"s\":\"t\"");
+      if (event.value >= 0) out.printf(",\"args\":{\"value\":%d}", event.value);
+      out.print("}");
+    }
+
+    out.print("]}\n");
+    enabled = wasEnabled;
+  }
+
+  private: struct Event {
+    uint32_t timestamp; // micros()
+    const char * name;
+    char phase; // 'B', 'E' or 'i'
+    uint8_t track;
+    int16_t value; // Shown as args.value when >= 0
+  };
+
+  Event events[CAPACITY];
+  std::atomic < uint32_t > head;
+  volatile bool enabled;
+
+  void record(char phase, Track track, const char * name, int16_t value) {
+    if (!enabled) return;
+
+    Event & event = events[head.fetch_add(1, std::memory_order_relaxed) % CAPACITY];
+    event.timestamp = micros();
+    event.name = name;
+    event.phase = phase;
+    event.track = track;
+    event.value = value;
+  }
+};
+
 // Main Network Manager Class
 class NetworkManager {
   public: enum NetworkMode {
     MODE_ETHERNET,
     MODE_WIFI,
     MODE_ETHERNET_WIFI_BACKUP,
-    MODE_WIFI_AP
+    MODE_WIFI_AP,
+    MODE_WIFI_AP_STA
   };
 
   enum NetworkState {
@@ -86,6 +846,43 @@ class NetworkManager {
     STATE_ERROR
   };
 
+  static
+  const int STATE_COUNT = STATE_ERROR + 1;
+
+  enum NetworkInterface {
+    INTERFACE_NONE,
+    INTERFACE_ETHERNET,
+    INTERFACE_WIFI,
+    INTERFACE_SOFTAP
+  };
+
+  // Event counters since begin()
+  struct Counters {
+    uint32_t connects;
+    uint32_t disconnects;
+    uint32_t authFailures;
+    uint32_t apNotFound;
+    uint32_t dhcpFailures;
+    uint32_t wifiAttempts;
+    uint32_t failovers;
+    uint32_t scans;
+  };
+
+  // Summary of the last completed scan
+  struct ScanSummary {
+    int count;
+    unsigned long durationMs;
+    unsigned long completedAt;
+    char strongestSsid[33];
+    int32_t strongestRssi;
+  };
+
+  enum ClientEvictionPolicy {
+    EVICT_NEVER,
+    EVICT_IDLE, // Deauthenticate every client idle for longer than the timeout
+    EVICT_IDLE_WHEN_FULL // Only free the most idle client once maxConnections is reached
+  };
+
   struct ScanResult {
     WiFiNetwork * networks;
     int count;
@@ -102,16 +899,48 @@ class NetworkManager {
   currentState(STATE_DISCONNECTED),
   isBackupActive(false),
   isSoftAPActive(false),
+  softAPChannel(0),
+  updateInProgress(false),
+  provisioning(nullptr),
+  lastInterface(INTERFACE_NONE),
+  interfaceGeneration(0),
+  wifiEventsRegistered(false),
+  apEventsRegistered(false),
+  stationPhase(STATION_IDLE),
+  stationCredentialIndex(0),
+  stationAttemptStart(0),
   lastWifiAttempt(0),
   isScanning(false),
-  scanMinRSSI(-100),
+  scanDone(false),
+  scanEventsRegistered(false),
+  scanChannelIndex(0),
+  scanBufferCount(0),
+  scanStartedAt(0),
+  lastScanDurationMs(0),
+  modeBeforeScan(WIFI_MODE_NULL),
+  scanSequence(0),
+  scanPassSequence(0),
+  scanAbortPending(false),
+  scanAbortedAt(0),
   onConnectedCallback(nullptr),
   onDisconnectedCallback(nullptr),
   onErrorCallback(nullptr),
   onDHCPTimeoutCallback(nullptr),
   onClientConnectedCallback(nullptr),
   onClientDisconnectedCallback(nullptr),
-  onIPAssignedCallback(nullptr) {}
+  onIPAssignedCallback(nullptr),
+  stateEnteredAt(0),
+  startedAt(0),
+  jsonArena(jsonArenaBuffer, sizeof(jsonArenaBuffer)),
+  clientEvents(nullptr),
+  clientRefreshDue(false),
+  lastClientRefresh(0),
+  evictionPolicy(EVICT_IDLE_WHEN_FULL),
+  clientIdleTimeout(300000) {
+    memset(stateDurations, 0, sizeof(stateDurations));
+    memset( & counters, 0, sizeof(counters));
+    memset( & lastScan, 0, sizeof(lastScan));
+  }
 
   bool hasValidWiFiConfig() {
     for (int i = 0; i < wifiConfig.MAX_WIFI_CREDENTIALS; i++) {
@@ -124,7 +953,13 @@ class NetworkManager {
   }
 
   void fallbackToSoftAP() {
+    if (currentMode == MODE_WIFI_AP_STA && isSoftAPActive) {
+      return; // Provisioning AP is already up
+    }
+
     Serial.println("Falling back to SoftAP mode");
+    counters.failovers++;
+    trace.instant(TraceRecorder::TRACK_EVENTS, "failover", INTERFACE_SOFTAP);
     currentMode = MODE_WIFI_AP;
     setupSoftAP();
   }
@@ -150,8 +985,11 @@ class NetworkManager {
   }
 
   void begin(NetworkMode mode = MODE_ETHERNET) {
+    TraceRecorder::Span span(trace, TraceRecorder::TRACK_NETWORK, "begin", mode);
     currentMode = mode;
-    currentState = STATE_SCANNING;
+    startedAt = millis();
+    stateEnteredAt = startedAt;
+    setState(STATE_SCANNING);
 
     switch (currentMode) {
     case MODE_ETHERNET:
@@ -167,6 +1005,9 @@ class NetworkManager {
     case MODE_WIFI_AP:
       setupSoftAP();
       break;
+    case MODE_WIFI_AP_STA:
+      setupSoftAPWithStation();
+      break;
     }
   }
 
@@ -198,6 +1039,44 @@ class NetworkManager {
     onIPAssignedCallback = onIPAssigned;
   }
 
+  // Apply the factory provisioning image from the "prov" partition. The image
+  // is checked (magic, version, size, CRC) through a flash mapping, with no
+  // parsing, then its fields are copied into the configs, which are held by
+  // value. Call before begin(); returns false if there is no valid image.
+  bool loadProvisioning() {
+    const esp_partition_t * partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+      (esp_partition_subtype_t) ProvisioningImage::PARTITION_SUBTYPE, "prov");
+    if (partition == nullptr) return false;
+
+    const void * mapped;
+    spi_flash_mmap_handle_t handle;
+    if (esp_partition_mmap(partition, 0, sizeof(ProvisioningImage), ESP_PARTITION_MMAP_DATA, & mapped, & handle) != ESP_OK) {
+      return false;
+    }
+
+    const ProvisioningImage * image = static_cast < const ProvisioningImage * > (mapped);
+    const uint8_t * bytes = static_cast < const uint8_t * > (mapped);
+    const size_t covered = offsetof(ProvisioningImage, flags);
+
+    if (image -> magic != ProvisioningImage::MAGIC || image -> version != ProvisioningImage::VERSION ||
+      image -> size != sizeof(ProvisioningImage) ||
+      esp_rom_crc32_le(0, bytes + covered, sizeof(ProvisioningImage) - covered) != image -> crc32) {
+      bool stamped = image -> magic == ProvisioningImage::MAGIC; // Read before the mapping goes away
+      spi_flash_munmap(handle);
+      if (stamped && onErrorCallback) onErrorCallback("Invalid provisioning image");
+      return false;
+    }
+
+    applyProvisioning( * image);
+    provisioning = image; // Mapping stays open for getProvisioning()
+    return true;
+  }
+
+  // Mapped provisioning image, or nullptr if none was loaded
+  const ProvisioningImage * getProvisioning() {
+    return provisioning;
+  }
+
   NetworkState getState() {
     return currentState;
   }
@@ -206,113 +1085,245 @@ class NetworkManager {
     return currentState == STATE_CONNECTED;
   }
 
-  IPAddress getIP() {
+  // Interface currently carrying traffic
+  NetworkInterface getActiveInterface() {
     switch (currentMode) {
+    case MODE_ETHERNET:
+      return INTERFACE_ETHERNET;
     case MODE_WIFI:
-      return WiFi.localIP();
+      return INTERFACE_WIFI;
     case MODE_ETHERNET_WIFI_BACKUP:
-      return WiFi.localIP();
-    case MODE_ETHERNET:
-      return Ethernet.localIP();
+      return isBackupActive ? INTERFACE_WIFI : INTERFACE_ETHERNET;
     case MODE_WIFI_AP:
-      return WiFi.softAPIP();
+      return INTERFACE_SOFTAP;
+    case MODE_WIFI_AP_STA:
+      return WiFi.isConnected() ? INTERFACE_WIFI : INTERFACE_SOFTAP;
     default:
-      return IPAddress(0, 0, 0, 0);
+      return INTERFACE_NONE;
     }
   }
 
-  // Synchronous network scan
-  ScanResult scanNetworks(int32_t minRSSI = -100) {
-    WiFi.mode(WIFI_STA); // Set WiFi mode to Station (STA)
-    int foundNetworks = WiFi.scanNetworks(); // Start network scan
+  NetworkMode getMode() {
+    return currentMode;
+  }
 
-    int validNetworks = 0;
-    for (int i = 0; i < foundNetworks; i++) {
-      if (WiFi.RSSI(i) >= minRSSI) {
-        validNetworks++; // Count valid networks based on RSSI
-      }
-    }
+  const Counters & getCounters() {
+    return counters;
+  }
 
-    // Prepare the result structure
-    ScanResult result;
-    result.networks = new WiFiNetwork[validNetworks];
-    result.count = validNetworks;
+  const ScanSummary & getLastScanSummary() {
+    return lastScan;
+  }
 
-    int index = 0;
-    for (int i = 0; i < foundNetworks && index < validNetworks; i++) {
-      if (WiFi.RSSI(i) >= minRSSI) {
-        // Copy network information to result
-        strncpy(result.networks[index].ssid, WiFi.SSID(i).c_str(), 32);
-        result.networks[index].ssid[32] = '\0'; // Ensure null termination
-        result.networks[index].rssi = WiFi.RSSI(i);
-        result.networks[index].authMode = WiFi.encryptionType(i);
+  // Milliseconds spent in a state since begin(), including the current stay
+  unsigned long getStateUptime(NetworkState state) {
+    unsigned long total = stateDurations[state];
+    if (state == currentState) total += millis() - stateEnteredAt;
+    return total;
+  }
 
-        // Detect hidden networks by checking if the SSID is empty
-        result.networks[index].isHidden = WiFi.SSID(i).length() == 0;
+  static
+  const char * modeName(NetworkMode mode) {
+    switch (mode) {
+    case MODE_ETHERNET:
+      return "ethernet";
+    case MODE_WIFI:
+      return "wifi";
+    case MODE_ETHERNET_WIFI_BACKUP:
+      return "ethernet_wifi_backup";
+    case MODE_WIFI_AP:
+      return "wifi_ap";
+    case MODE_WIFI_AP_STA:
+      return "wifi_ap_sta";
+    default:
+      return "unknown";
+    }
+  }
 
-        index++;
-      }
+  static
+  const char * stateName(NetworkState state) {
+    switch (state) {
+    case STATE_DISCONNECTED:
+      return "disconnected";
+    case STATE_SCANNING:
+      return "scanning";
+    case STATE_CONNECTING:
+      return "connecting";
+    case STATE_WAITING_FOR_IP:
+      return "waiting_for_ip";
+    case STATE_CONNECTED:
+      return "connected";
+    case STATE_CONNECTION_LOST:
+      return "connection_lost";
+    case STATE_WRONG_PASSWORD:
+      return "wrong_password";
+    case STATE_NO_AP_FOUND:
+      return "no_ap_found";
+    case STATE_ERROR:
+      return "error";
+    default:
+      return "unknown";
     }
+  }
 
-    WiFi.scanDelete(); // Clean up scan data
-    return result;
+  static
+  const char * interfaceName(NetworkInterface iface) {
+    switch (iface) {
+    case INTERFACE_ETHERNET:
+      return "ethernet";
+    case INTERFACE_WIFI:
+      return "wifi";
+    case INTERFACE_SOFTAP:
+      return "softap";
+    default:
+      return "none";
+    }
   }
 
-  // Asynchronous scan start
-  void startAsyncScan(int32_t minRSSI = -100) {
-    scanMinRSSI = minRSSI;
-    if (!isScanning) {
-      isScanning = true;
-      WiFi.mode(WIFI_STA);
-      WiFi.scanNetworks(true);
+  // Serialize a status snapshot into buffer. Returns the length written, or 0
+  // if the snapshot does not fit. Uses a fixed arena, no heap allocations;
+  // call from one task at a time.
+  size_t writeStatusJson(char * buffer, size_t size) {
+    JsonDocument doc( & jsonArena);
+    if (!buildStatusJson(doc)) return 0;
+
+    size_t length = serializeJson(doc, buffer, size);
+    return length < size ? length : 0;
+  }
+
+  // Stream a status snapshot to any Print sink (Serial, a client, ...)
+  size_t writeStatusJson(Print & out) {
+    JsonDocument doc( & jsonArena);
+    if (!buildStatusJson(doc)) return 0;
+
+    return serializeJson(doc, out);
+  }
+
+  // High-water mark of the status JSON arena, in bytes
+  size_t getStatusJsonPeakMemory() {
+    return jsonArena.peakUsage();
+  }
+
+  IPAddress getIP() {
+    switch (getActiveInterface()) {
+    case INTERFACE_ETHERNET:
+      return Ethernet.localIP();
+    case INTERFACE_WIFI:
+      return WiFi.localIP();
+    case INTERFACE_SOFTAP:
+      return WiFi.softAPIP();
+    default:
+      return IPAddress(0, 0, 0, 0);
     }
   }
 
-  bool getAsyncScanResult(ScanResult & result) {
-    if (!isScanning) return false;
+  // Incremented every time the active interface changes; transport clients
+  // compare it to notice a failover
+  uint32_t getInterfaceGeneration() {
+    return interfaceGeneration;
+  }
+
+  BufferPool & getBufferPool() {
+    return bufferPool;
+  }
 
-    int16_t scanComplete = WiFi.scanComplete();
-    if (scanComplete == WIFI_SCAN_RUNNING) return false; // Scan is still running
+  // Timeline of states, setup phases, scans and failovers; see writeChromeTrace()
+  TraceRecorder & getTrace() {
+    return trace;
+  }
 
-    isScanning = false;
+  // DNS servers for the active interface: the ones supplied by DHCP, then the
+  // statically configured one. Returns the number written to servers.
+  int getDnsServers(IPAddress * servers, int max) {
+    IPAddress candidates[3];
+    int found = 0;
 
-    if (scanComplete == WIFI_SCAN_FAILED) {
-      result.networks = nullptr; // No networks found
-      result.count = 0;
-      return true;
+    switch (getActiveInterface()) {
+    case INTERFACE_ETHERNET:
+      candidates[found++] = Ethernet.dnsServerIP();
+      candidates[found++] = ethConfig.dns;
+      break;
+    case INTERFACE_WIFI:
+      candidates[found++] = WiFi.dnsIP(0);
+      candidates[found++] = WiFi.dnsIP(1);
+      candidates[found++] = wifiConfig.dns;
+      break;
+    default:
+      break;
     }
 
-    // Count valid networks based on RSSI threshold
-    int validNetworks = 0;
-    for (int i = 0; i < scanComplete; i++) {
-      if (WiFi.RSSI(i) >= scanMinRSSI) {
-        validNetworks++;
+    int count = 0;
+    for (int i = 0; i < found && count < max; i++) {
+      if (candidates[i] == IPAddress(0, 0, 0, 0)) continue;
+
+      bool duplicate = false;
+      for (int j = 0; j < count; j++) {
+        if (servers[j] == candidates[i]) duplicate = true;
       }
+      if (!duplicate) servers[count++] = candidates[i];
     }
+    return count;
+  }
 
-    // Allocate memory for valid networks
-    result.networks = new WiFiNetwork[validNetworks];
-    result.count = validNetworks;
+  // Synchronous network scan
+  ScanResult scanNetworks(int32_t minRSSI = -100) {
+    ScanConfig config;
+    config.minRSSI = minRSSI;
+    return scanNetworks(config);
+  }
 
-    // Populate the result with valid networks
-    int index = 0;
-    for (int i = 0; i < scanComplete && index < validNetworks; i++) {
-      if (WiFi.RSSI(i) >= scanMinRSSI) {
-        // Copy SSID and other network data
-        strncpy(result.networks[index].ssid, WiFi.SSID(i).c_str(), 32);
-        result.networks[index].ssid[32] = '\0'; // Ensure null-termination
-        result.networks[index].rssi = WiFi.RSSI(i);
-        result.networks[index].authMode = WiFi.encryptionType(i);
+  // Synchronous scan using an explicit channel list, dwell times and filters.
+  // The radio mode is left alone if the station interface is already up, so an
+  // existing association or SoftAP session is not disturbed. Otherwise the
+  // station interface is raised for the scan and dropped again afterwards.
+  ScanResult scanNetworks(const ScanConfig & config) {
+    ScanResult result;
 
-        // Check if SSID is empty and assume the network is hidden
-        result.networks[index].isHidden = WiFi.SSID(i).length() == 0;
+    if (isScanning || updateInProgress || !startScanEngine(config)) {
+      return result;
+    }
 
-        index++;
-      }
+    unsigned long deadline = millis() + scanTimeout();
+    while (!scanDone && (long)(deadline - millis()) > 0) {
+      delay(1);
+    }
+
+    if (!scanDone) {
+      abortScan();
+      if (onErrorCallback) onErrorCallback("WiFi scan timed out");
+    }
+
+    isScanning = false;
+    collectScanResult(result);
+    restoreScanMode();
+    return result;
+  }
+
+  // Asynchronous scan start
+  void startAsyncScan(int32_t minRSSI = -100) {
+    ScanConfig config;
+    config.minRSSI = minRSSI;
+    startAsyncScan(config);
+  }
+
+  bool startAsyncScan(const ScanConfig & config) {
+    if (isScanning || updateInProgress) return false;
+    return startScanEngine(config);
+  }
+
+  bool getAsyncScanResult(ScanResult & result) {
+    if (!isScanning) return false;
+
+    if (!scanDone) {
+      if ((long)(millis() - scanStartedAt) < (long) scanTimeout()) return false; // Scan is still running
+
+      abortScan();
+      if (onErrorCallback) onErrorCallback("WiFi scan timed out");
     }
 
-    // Clean up scan data
-    WiFi.scanDelete();
+    isScanning = false;
+    collectScanResult(result);
+    restoreScanMode();
     return true;
   }
 
@@ -320,14 +1331,53 @@ class NetworkManager {
     return isScanning;
   }
 
+  // Duration of the last completed scan in milliseconds
+  unsigned long getLastScanDuration() {
+    return lastScanDurationMs;
+  }
+
   void startWiFiScan() {
-    if (!isScanning) {
-      WiFi.scanNetworks(true); // Start async scan
-      isScanning = true;
+    if (startAsyncScan(ScanConfig())) {
       Serial.println("WiFi scan started...");
     }
   }
 
+  // Clients currently attached to the SoftAP; safe to read from any task
+  const SoftAPClientTable & getSoftAPClients() {
+    return apClients;
+  }
+
+  bool getSoftAPClient(const uint8_t * mac, SoftAPClient & client) {
+    return apClients.find(mac, client);
+  }
+
+  // Account traffic served to a SoftAP client (e.g. from a web server handler).
+  // Safe to call from any task; the table is updated from update().
+  void noteClientTraffic(const IPAddress & ip, uint32_t bytes, uint32_t queries = 1) {
+    ClientEvent event;
+    memset( & event, 0, sizeof(event));
+    event.type = CLIENT_TRAFFIC;
+    event.ip = (uint32_t) ip;
+    event.bytes = bytes;
+    event.queries = queries;
+    postClientEvent(event);
+  }
+
+  // While a firmware update is running, scans, station retries and
+  // interface switches are held so the uplink stays where it is
+  void setUpdateInProgress(bool active) {
+    updateInProgress = active;
+  }
+
+  bool isUpdateInProgress() {
+    return updateInProgress;
+  }
+
+  void setClientEvictionPolicy(ClientEvictionPolicy policy, unsigned long idleTimeoutMs = 300000) {
+    evictionPolicy = policy;
+    clientIdleTimeout = idleTimeoutMs;
+  }
+
   void update() {
 
     switch (currentMode) {
@@ -343,6 +1393,17 @@ class NetworkManager {
     case MODE_WIFI_AP:
       updateSoftAP();
       break;
+    case MODE_WIFI_AP_STA:
+      updateSoftAP();
+      updateStation();
+      break;
+    }
+
+    NetworkInterface iface = getActiveInterface();
+    if (iface != lastInterface) {
+      lastInterface = iface;
+      interfaceGeneration++;
+      trace.instant(TraceRecorder::TRACK_EVENTS, "interface", iface);
     }
   }
 
@@ -353,11 +1414,49 @@ class NetworkManager {
   SoftAPConfig apConfig;
   bool isBackupActive;
   bool isSoftAPActive;
+  uint8_t softAPChannel; // Current SoftAP channel; differs from apConfig once it follows the uplink
+  volatile bool updateInProgress;
+  const ProvisioningImage * provisioning;
+  NetworkInterface lastInterface;
+  volatile uint32_t interfaceGeneration;
+  BufferPool bufferPool;
+  bool wifiEventsRegistered;
+  bool apEventsRegistered;
+
+  // Station side of MODE_WIFI_AP_STA
+  enum StationPhase {
+    STATION_IDLE,
+    STATION_LOCATING,
+    STATION_ASSOCIATING
+  };
+  StationPhase stationPhase;
+  int stationCredentialIndex;
+  unsigned long stationAttemptStart;
+  static
+  const unsigned long STATION_CONNECT_TIMEOUT = 15000;
+  static
+  const uint32_t STATION_LOCATE_DWELL = 60; // Keep off-channel time short for SoftAP clients
   static
   const int ETH_CS_PIN = 16;
   unsigned long lastWifiAttempt;
-  bool isScanning;
-  int32_t scanMinRSSI;
+  volatile bool isScanning;
+  volatile bool scanDone;
+  bool scanEventsRegistered;
+  ScanConfig activeScan;
+  uint8_t scanChannelIndex;
+  static
+  const int MAX_SCAN_RESULTS = 32;
+  WiFiNetwork scanBuffer[MAX_SCAN_RESULTS];
+  int scanBufferCount;
+  unsigned long scanStartedAt;
+  unsigned long lastScanDurationMs;
+  wifi_mode_t modeBeforeScan;
+  volatile uint32_t scanSequence; // Bumped per scan and per abort
+  volatile uint32_t scanPassSequence; // scanSequence of the pass in flight
+  volatile bool scanAbortPending; // Expecting the SCAN_DONE posted by esp_wifi_scan_stop()
+  unsigned long scanAbortedAt;
+  static
+  const unsigned long SCAN_ABORT_GRACE = 100;
   static
   const unsigned long WIFI_RETRY_DELAY = 30000;
   DNSServer dnsServer;
@@ -380,23 +1479,189 @@ class NetworkManager {
 
   void( * onIPAssignedCallback)(void);
 
+  // Status accounting
+  unsigned long stateDurations[STATE_COUNT];
+  unsigned long stateEnteredAt;
+  unsigned long startedAt;
+  Counters counters;
+  ScanSummary lastScan;
+  alignas(8) uint8_t jsonArenaBuffer[NETMANAGER_STATUS_JSON_ARENA]; // StaticJsonArena hands out 8-byte aligned blocks
+  StaticJsonArena jsonArena;
+  TraceRecorder trace;
+
+  void setState(NetworkState state) {
+    if (state == currentState) return;
+
+    unsigned long now = millis();
+    stateDurations[currentState] += now - stateEnteredAt;
+    stateEnteredAt = now;
+
+    switch (state) {
+    case STATE_CONNECTED:
+      counters.connects++;
+      break;
+    case STATE_DISCONNECTED:
+    case STATE_CONNECTION_LOST:
+      if (currentState == STATE_CONNECTED) counters.disconnects++;
+      break;
+    case STATE_WRONG_PASSWORD:
+      counters.authFailures++;
+      break;
+    case STATE_NO_AP_FOUND:
+      counters.apNotFound++;
+      break;
+    default:
+      break;
+    }
+
+    trace.end(TraceRecorder::TRACK_STATE, stateName(currentState));
+    trace.begin(TraceRecorder::TRACK_STATE, stateName(state), state);
+    currentState = state;
+  }
+
+  static void formatIP(char * out, const IPAddress & ip) {
+    snprintf(out, 16, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  }
+
+  static void formatMac(char * out, const uint8_t * mac) {
+    snprintf(out, 18, "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  }
+
+  bool buildStatusJson(JsonDocument & doc) {
+    char text[18];
+    unsigned long now = millis();
+    NetworkInterface iface = getActiveInterface();
+
+    jsonArena.reset();
+
+    doc["mode"] = modeName(currentMode);
+    doc["state"] = stateName(currentState);
+    doc["interface"] = interfaceName(iface);
+    doc["uptime"] = now - startedAt;
+
+    IPAddress ip, gateway, subnet, dns;
+    switch (iface) {
+    case INTERFACE_ETHERNET:
+      ip = Ethernet.localIP();
+      gateway = Ethernet.gatewayIP();
+      subnet = Ethernet.subnetMask();
+      dns = Ethernet.dnsServerIP();
+      break;
+    case INTERFACE_WIFI:
+      ip = WiFi.localIP();
+      gateway = WiFi.gatewayIP();
+      subnet = WiFi.subnetMask();
+      dns = WiFi.dnsIP();
+      break;
+    case INTERFACE_SOFTAP:
+      ip = WiFi.softAPIP();
+      break;
+    default:
+      break;
+    }
+    formatIP(text, ip);
+    doc["ip"] = text;
+    formatIP(text, gateway);
+    doc["gateway"] = text;
+    formatIP(text, subnet);
+    doc["subnet"] = text;
+    formatIP(text, dns);
+    doc["dns"] = text;
+
+    if (WiFi.isConnected()) {
+      JsonObject wifi = doc["wifi"].to < JsonObject > ();
+      wifi["rssi"] = WiFi.RSSI();
+      formatMac(text, WiFi.BSSID());
+      wifi["bssid"] = text;
+      wifi["channel"] = WiFi.channel();
+    }
+
+    if (isSoftAPActive) {
+      JsonObject softap = doc["softap"].to < JsonObject > ();
+      softap["channel"] = softAPChannel;
+      softap["clients"] = apClients.size();
+    }
+
+    JsonObject states = doc["stateUptime"].to < JsonObject > ();
+    for (int i = 0; i < STATE_COUNT; i++) {
+      states[stateName((NetworkState) i)] = getStateUptime((NetworkState) i);
+    }
+
+    JsonObject counts = doc["counters"].to < JsonObject > ();
+    counts["connects"] = counters.connects;
+    counts["disconnects"] = counters.disconnects;
+    counts["authFailures"] = counters.authFailures;
+    counts["apNotFound"] = counters.apNotFound;
+    counts["dhcpFailures"] = counters.dhcpFailures;
+    counts["wifiAttempts"] = counters.wifiAttempts;
+    counts["failovers"] = counters.failovers;
+    counts["scans"] = counters.scans;
+
+    if (lastScan.completedAt != 0) {
+      JsonObject scan = doc["scan"].to < JsonObject > ();
+      scan["count"] = lastScan.count;
+      scan["durationMs"] = lastScan.durationMs;
+      scan["ageMs"] = now - lastScan.completedAt;
+      if (lastScan.count > 0) {
+        scan["strongestSsid"] = lastScan.strongestSsid;
+        scan["strongestRssi"] = lastScan.strongestRssi;
+      }
+    }
+
+    if (doc.overflowed()) {
+      if (onErrorCallback) onErrorCallback("Status JSON arena too small");
+      return false;
+    }
+    return true;
+  }
+
+  // SoftAP client tracking
+  enum ClientEventType: uint8_t {
+    CLIENT_JOINED,
+    CLIENT_LEFT,
+    CLIENT_TRAFFIC
+  };
+
+  struct ClientEvent {
+    ClientEventType type;
+    uint8_t mac[6];
+    uint32_t ip;
+    uint32_t bytes;
+    uint32_t queries;
+  };
+
+  SoftAPClientTable apClients;
+  QueueHandle_t clientEvents; // WiFi event task and other tasks -> update()
+  volatile bool clientRefreshDue;
+  unsigned long lastClientRefresh;
+  ClientEvictionPolicy evictionPolicy;
+  unsigned long clientIdleTimeout;
+  static
+  const int CLIENT_EVENT_QUEUE_LENGTH = 16;
+  static
+  const unsigned long CLIENT_REFRESH_INTERVAL = 2000;
+
   // Setup Wi-Fi events
   void setupWiFiEvents() {
+    if (wifiEventsRegistered) return;
+    wifiEventsRegistered = true;
+
     WiFi.onEvent([this](WiFiEvent_t event, WiFiEventInfo_t info) {
       switch (event) {
-      case SYSTEM_EVENT_STA_START:
-        currentState = STATE_SCANNING;
+      case ARDUINO_EVENT_WIFI_STA_START:
+        setState(STATE_SCANNING);
         break;
-      case SYSTEM_EVENT_STA_GOT_IP:
-        currentState = STATE_CONNECTED;
+      case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+        setState(STATE_CONNECTED);
         if (onConnectedCallback) onConnectedCallback();
         if (onIPAssignedCallback) onIPAssignedCallback();
         break;
-      case SYSTEM_EVENT_STA_DISCONNECTED:
+      case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+        trace.instant(TraceRecorder::TRACK_EVENTS, "disconnected", info.wifi_sta_disconnected.reason);
         handleWiFiDisconnection(info.wifi_sta_disconnected.reason); // Disconnection reason
         break;
-      case SYSTEM_EVENT_STA_CONNECTED:
-        currentState = STATE_WAITING_FOR_IP;
+      case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+        setState(STATE_WAITING_FOR_IP);
         break;
       default:
         break;
@@ -404,27 +1669,235 @@ class NetworkManager {
     });
   }
 
+  // Bring up the station interface without dropping an active SoftAP
+  bool ensureStationInterface() {
+    wifi_mode_t mode = WiFi.getMode();
+    if (mode == WIFI_MODE_STA || mode == WIFI_MODE_APSTA) {
+      return true;
+    }
+    return WiFi.mode(mode == WIFI_MODE_AP ? WIFI_MODE_APSTA : WIFI_MODE_STA);
+  }
+
+  // Upper bound for a whole scan, used to recover from a lost SCAN_DONE event
+  unsigned long scanTimeout() {
+    int channels = activeScan.channelCount > 0 ? activeScan.channelCount : ScanConfig::MAX_CHANNELS;
+    return (unsigned long) channels * (activeScan.maxDwellMs + 50) + 1000;
+  }
+
+  // Put back the radio mode a scan found, e.g. plain AP in MODE_WIFI_AP, unless
+  // the station has associated in the meantime
+  void restoreScanMode() {
+    if (modeBeforeScan == WIFI_MODE_STA || modeBeforeScan == WIFI_MODE_APSTA) return;
+    if (WiFi.isConnected()) return;
+    WiFi.mode(modeBeforeScan);
+  }
+
+  bool startScanEngine(const ScanConfig & config) {
+    modeBeforeScan = WiFi.getMode();
+    if (!ensureStationInterface()) {
+      if (onErrorCallback) onErrorCallback("Unable to enable station interface for scan");
+      return false;
+    }
+
+    if (!scanEventsRegistered) {
+      // Runs after the WiFi library has fetched the AP records for this pass
+      WiFi.onEvent([this](WiFiEvent_t event, WiFiEventInfo_t info) {
+        handleScanDone();
+      }, ARDUINO_EVENT_WIFI_SCAN_DONE);
+      scanEventsRegistered = true;
+    }
+
+    // Let the SCAN_DONE of an aborted scan drain so it is not taken for this one
+    while (scanAbortPending && millis() - scanAbortedAt < SCAN_ABORT_GRACE) {
+      delay(1);
+    }
+    scanAbortPending = false;
+
+    scanSequence++;
+    activeScan = config;
+    scanChannelIndex = 0;
+    scanBufferCount = 0;
+    scanDone = false;
+    isScanning = true;
+    scanStartedAt = millis();
+    trace.begin(TraceRecorder::TRACK_SCAN, "scan", config.channelCount);
+
+    if (!startScanChannel()) {
+      trace.end(TraceRecorder::TRACK_SCAN, "scan");
+      isScanning = false;
+      restoreScanMode();
+      if (onErrorCallback) onErrorCallback("WiFi scan could not be started");
+      return false;
+    }
+    return true;
+  }
+
+  // Start one scan pass: a single channel from the list, or all channels
+  bool startScanChannel() {
+    wifi_scan_config_t conf;
+    memset( & conf, 0, sizeof(conf));
+    conf.ssid = activeScan.ssid[0] != '\0' ? (uint8_t * ) activeScan.ssid : nullptr;
+    conf.bssid = activeScan.filterBssid ? activeScan.bssid : nullptr;
+    conf.channel = activeScan.channelCount > 0 ? activeScan.channels[scanChannelIndex] : 0;
+    conf.show_hidden = activeScan.showHidden;
+
+    if (activeScan.passive) {
+      conf.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+      conf.scan_time.passive = activeScan.maxDwellMs;
+    } else {
+      conf.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+      conf.scan_time.active.min = activeScan.minDwellMs;
+      conf.scan_time.active.max = activeScan.maxDwellMs;
+    }
+
+    if (esp_wifi_scan_start( & conf, false) != ESP_OK) return false;
+    scanPassSequence = scanSequence;
+    return true;
+  }
+
+  // Give up on the running scan. isScanning is cleared and the sequence bumped
+  // before stopping, so neither a pass being harvested nor the SCAN_DONE that
+  // esp_wifi_scan_stop() posts can start another channel or touch the next scan.
+  void abortScan() {
+    scanSequence++;
+    isScanning = false;
+    scanAbortPending = true;
+    scanAbortedAt = millis();
+    esp_wifi_scan_stop();
+    trace.end(TraceRecorder::TRACK_SCAN, "scan");
+    trace.instant(TraceRecorder::TRACK_SCAN, "scanTimeout");
+  }
+
+  // Called from the WiFi event task when a scan pass finishes
+  void handleScanDone() {
+    if (scanAbortPending) {
+      scanAbortPending = false; // Posted by abortScan()
+      return;
+    }
+    if (!isScanning || scanDone || scanPassSequence != scanSequence) return;
+
+    uint32_t sequence = scanSequence;
+    harvestScanPass();
+    if (sequence != scanSequence) return; // Aborted while harvesting
+
+    scanChannelIndex++;
+    if (scanChannelIndex < activeScan.channelCount && startScanChannel()) {
+      return; // Next channel in the list
+    }
+
+    lastScanDurationMs = millis() - scanStartedAt;
+    recordScanSummary();
+    trace.end(TraceRecorder::TRACK_SCAN, "scan");
+    scanDone = true;
+  }
+
+  void recordScanSummary() {
+    ScanSummary summary;
+    memset( & summary, 0, sizeof(summary));
+    summary.count = scanBufferCount;
+    summary.durationMs = lastScanDurationMs;
+    summary.completedAt = millis();
+    summary.strongestRssi = -127;
+
+    for (int i = 0; i < scanBufferCount; i++) {
+      if (scanBuffer[i].rssi > summary.strongestRssi) {
+        summary.strongestRssi = scanBuffer[i].rssi;
+        strcpy(summary.strongestSsid, scanBuffer[i].ssid);
+      }
+    }
+
+    lastScan = summary;
+    counters.scans++;
+  }
+
+  void harvestScanPass() {
+    int16_t found = WiFi.scanComplete();
+
+    for (int i = 0; i < found && scanBufferCount < MAX_SCAN_RESULTS; i++) {
+      if (WiFi.RSSI(i) < activeScan.minRSSI) continue;
+
+      WiFiNetwork & network = scanBuffer[scanBufferCount++];
+      strncpy(network.ssid, WiFi.SSID(i).c_str(), 32);
+      network.ssid[32] = '\0'; // Ensure null termination
+      network.rssi = WiFi.RSSI(i);
+      network.authMode = WiFi.encryptionType(i);
+      network.isHidden = network.ssid[0] == '\0';
+      memcpy(network.bssid, WiFi.BSSID(i), sizeof(network.bssid));
+      network.channel = WiFi.channel(i);
+    }
+
+    WiFi.scanDelete(); // Clean up scan data
+  }
+
+  void collectScanResult(ScanResult & result) {
+    if (result.networks != nullptr) {
+      delete[] result.networks;
+    }
+
+    result.networks = nullptr;
+    result.count = scanBufferCount;
+    if (scanBufferCount > 0) {
+      result.networks = new WiFiNetwork[scanBufferCount];
+      memcpy(result.networks, scanBuffer, scanBufferCount * sizeof(WiFiNetwork));
+    }
+  }
+
+  static void applyAddressing(NetworkConfig & config, const ProvisioningImage::Addressing & address, bool isStatic) {
+    config.isDhcp = !isStatic;
+    if (!isStatic) return;
+
+    config.ip = IPAddress(address.ip[0], address.ip[1], address.ip[2], address.ip[3]);
+    config.gateway = IPAddress(address.gateway[0], address.gateway[1], address.gateway[2], address.gateway[3]);
+    config.subnet = IPAddress(address.subnet[0], address.subnet[1], address.subnet[2], address.subnet[3]);
+    config.dns = IPAddress(address.dns[0], address.dns[1], address.dns[2], address.dns[3]);
+  }
+
+  void applyProvisioning(const ProvisioningImage & image) {
+    if (image.flags & ProvisioningImage::HAS_ETH_MAC) {
+      memcpy(EthMacAddress, image.ethMac, sizeof(EthMacAddress));
+    }
+
+    for (int i = 0; i < NetworkConfig::MAX_WIFI_CREDENTIALS; i++) {
+      NetworkConfig::WiFiCredential & credential = wifiConfig.credentials[i];
+      memcpy(credential.ssid, image.wifi[i].ssid, sizeof(credential.ssid));
+      memcpy(credential.password, image.wifi[i].password, sizeof(credential.password));
+      credential.authMode = (wifi_auth_mode_t) image.wifi[i].authMode;
+    }
+    applyAddressing(wifiConfig, image.wifiAddress, image.flags & ProvisioningImage::WIFI_STATIC_IP);
+    applyAddressing(ethConfig, image.ethAddress, image.flags & ProvisioningImage::ETH_STATIC_IP);
+
+    if (image.flags & ProvisioningImage::HAS_SOFTAP) {
+      memcpy(apConfig.ssid, image.softAP.ssid, sizeof(apConfig.ssid));
+      memcpy(apConfig.password, image.softAP.password, sizeof(apConfig.password));
+      apConfig.channel = image.softAP.channel;
+      apConfig.authMode = (wifi_auth_mode_t) image.softAP.authMode;
+      apConfig.maxConnections = image.softAP.maxConnections;
+      apConfig.hidden = image.softAP.hidden != 0;
+    }
+  }
+
   void handleWiFiDisconnection(uint8_t reason) {
     switch (reason) {
     case WIFI_REASON_AUTH_FAIL:
-      currentState = STATE_WRONG_PASSWORD;
+      setState(STATE_WRONG_PASSWORD);
       if (onErrorCallback) onErrorCallback("Authentication failed");
       break;
     case WIFI_REASON_NO_AP_FOUND:
-      currentState = STATE_NO_AP_FOUND;
+      setState(STATE_NO_AP_FOUND);
       if (onErrorCallback) onErrorCallback("No AP found");
       break;
     case WIFI_REASON_ASSOC_LEAVE:
-      currentState = STATE_CONNECTION_LOST;
+      setState(STATE_CONNECTION_LOST);
       if (onDisconnectedCallback) onDisconnectedCallback();
       break;
     default:
-      currentState = STATE_DISCONNECTED;
+      setState(STATE_DISCONNECTED);
       if (onDisconnectedCallback) onDisconnectedCallback();
     }
   }
 
   void setupEthernet() {
+    TraceRecorder::Span span(trace, TraceRecorder::TRACK_NETWORK, "setupEthernet");
     SPI.begin();
     Ethernet.init(ETH_CS_PIN);
 
@@ -436,7 +1909,11 @@ class NetworkManager {
 
     if (ethConfig.isDhcp) {
       unsigned long dhcpStart = millis();
-      if (Ethernet.begin(EthMacAddress) == 0) { // Pass MAC address to begin()
+      trace.begin(TraceRecorder::TRACK_NETWORK, "dhcp");
+      int leased = Ethernet.begin(EthMacAddress); // Pass MAC address to begin()
+      trace.end(TraceRecorder::TRACK_NETWORK, "dhcp");
+      if (leased == 0) {
+        counters.dhcpFailures++;
         if (onErrorCallback) onErrorCallback("DHCP configuration failed");
         fallbackToWiFi();
         return;
@@ -445,10 +1922,12 @@ class NetworkManager {
       Ethernet.begin(EthMacAddress, ethConfig.ip, ethConfig.dns, ethConfig.gateway, ethConfig.subnet); // Pass MAC address and static IP config
     }
 
+    trace.begin(TraceRecorder::TRACK_NETWORK, "linkSettle");
     delay(1000);
+    trace.end(TraceRecorder::TRACK_NETWORK, "linkSettle");
 
     if (Ethernet.linkStatus() == LinkON) {
-      currentState = STATE_CONNECTED;
+      setState(STATE_CONNECTED);
       if (onConnectedCallback) onConnectedCallback();
     } else {
       fallbackToWiFi();
@@ -458,6 +1937,8 @@ class NetworkManager {
   void fallbackToWiFi() {
     if (hasValidWiFiConfig()) {
       Serial.println("Falling back to WiFi mode");
+      counters.failovers++;
+      trace.instant(TraceRecorder::TRACK_EVENTS, "failover", INTERFACE_WIFI);
       currentMode = MODE_WIFI;
       setupWiFi();
     } else {
@@ -472,7 +1953,7 @@ class NetworkManager {
       return;
     }
 
-    WiFi.mode(WIFI_STA);
+    ensureStationInterface(); // Keeps a running SoftAP up
     setupWiFiEvents();
 
     // Try to connect with the first WiFi credentials
@@ -488,12 +1969,14 @@ class NetworkManager {
 
   // Attempt to connect using the specified WiFi credential index
   bool tryWiFiConnection(int index) {
+    TraceRecorder::Span span(trace, TraceRecorder::TRACK_NETWORK, "tryWiFiConnection", index);
     wifi_config_t conf;
     memset( & conf, 0, sizeof(conf));
     strncpy((char * ) conf.sta.ssid, wifiConfig.credentials[index].ssid, sizeof(conf.sta.ssid));
     strncpy((char * ) conf.sta.password, wifiConfig.credentials[index].password, sizeof(conf.sta.password));
 
     esp_wifi_set_config(WIFI_IF_STA, & conf);
+    counters.wifiAttempts++;
 
     if (wifiConfig.isDhcp) {
       WiFi.begin(wifiConfig.credentials[index].ssid, wifiConfig.credentials[index].password);
@@ -503,12 +1986,14 @@ class NetworkManager {
     }
 
     unsigned long startAttempt = millis();
+    trace.begin(TraceRecorder::TRACK_NETWORK, "waitForConnection");
     while (WiFi.status() != WL_CONNECTED && millis() - startAttempt < 30000) {
       delay(500);
     }
+    trace.end(TraceRecorder::TRACK_NETWORK, "waitForConnection");
 
     if (WiFi.status() == WL_CONNECTED) {
-      currentState = STATE_CONNECTED;
+      setState(STATE_CONNECTED);
       if (onConnectedCallback) onConnectedCallback();
       return true;
     }
@@ -523,7 +2008,24 @@ class NetworkManager {
 
   void setupSoftAP() {
     WiFi.mode(WIFI_AP);
+    startSoftAP();
+  }
+
+  // SoftAP and DNS server stay up while the station side connects in the background
+  void setupSoftAPWithStation() {
+    WiFi.mode(WIFI_AP_STA);
+    WiFi.setAutoReconnect(false); // Station retries are paced by updateStation()
+    startSoftAP();
+    setupWiFiEvents();
 
+    stationPhase = STATION_IDLE;
+    stationCredentialIndex = 0;
+    lastWifiAttempt = millis() - WIFI_RETRY_DELAY; // First attempt right away
+    setState(STATE_DISCONNECTED);
+  }
+
+  void startSoftAP() {
+    TraceRecorder::Span span(trace, TraceRecorder::TRACK_NETWORK, "startSoftAP");
     if (apConfig.authMode != WIFI_AUTH_OPEN && strlen(apConfig.password) < 8) {
       if (onErrorCallback) onErrorCallback("AP password must be at least 8 characters");
       return;
@@ -531,73 +2033,333 @@ class NetworkManager {
 
     WiFi.softAP(apConfig.ssid, apConfig.password, apConfig.channel,
       apConfig.hidden, apConfig.maxConnections);
+    softAPChannel = apConfig.channel;
 
     dnsServer.start(53, "*", WiFi.softAPIP());
 
     isSoftAPActive = true;
-    currentState = STATE_CONNECTED;
+    if (currentMode == MODE_WIFI_AP) {
+      setState(STATE_CONNECTED); // In MODE_WIFI_AP_STA the state tracks the station side
+    }
+
+    if (apEventsRegistered) return;
+    apEventsRegistered = true;
+
+    if (clientEvents == nullptr) {
+      clientEvents = xQueueCreate(CLIENT_EVENT_QUEUE_LENGTH, sizeof(ClientEvent));
+    }
 
     WiFi.onEvent([this](WiFiEvent_t event, WiFiEventInfo_t info) {
+      ClientEvent clientEvent;
+      memset( & clientEvent, 0, sizeof(clientEvent));
+
       switch (event) {
-      case SYSTEM_EVENT_AP_STACONNECTED:
+      case ARDUINO_EVENT_WIFI_AP_STACONNECTED:
+        clientEvent.type = CLIENT_JOINED;
+        memcpy(clientEvent.mac, info.wifi_ap_staconnected.mac, 6);
+        postClientEvent(clientEvent);
         if (onClientConnectedCallback) {
           onClientConnectedCallback(event, info);
         }
         break;
-      case SYSTEM_EVENT_AP_STADISCONNECTED:
+      case ARDUINO_EVENT_WIFI_AP_STADISCONNECTED:
+        clientEvent.type = CLIENT_LEFT;
+        memcpy(clientEvent.mac, info.wifi_ap_stadisconnected.mac, 6);
+        postClientEvent(clientEvent);
         if (onClientDisconnectedCallback) {
           onClientDisconnectedCallback(event, info);
         }
         break;
+      case ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED:
+        clientRefreshDue = true; // The event carries no MAC; pick the IP up from the station list
+        break;
+      default:
+        break;
       }
     });
   }
 
-  void updateEthernet() {
-    if (currentState == STATE_CONNECTED) {
-      if (Ethernet.linkStatus() != LinkON) {
-        currentState = STATE_DISCONNECTED;
-        if (onDisconnectedCallback) onDisconnectedCallback();
-        //                fallbackToWiFi();
-      } else if (ethConfig.isDhcp) {
-        // Check if we still have a valid IP
-        IPAddress currentIP = Ethernet.localIP();
-        if (currentIP == IPAddress(0, 0, 0, 0)) {
-          if (onErrorCallback) onErrorCallback("Lost DHCP lease");
-          //                    fallbackToWiFi();
-        }
-      }
+  void postClientEvent(const ClientEvent & event) {
+    if (clientEvents != nullptr) {
+      xQueueSend(clientEvents, & event, 0); // Drop rather than block the sender
     }
   }
 
-  void updateWiFi() {
-    if (currentState == STATE_DISCONNECTED ||
-      currentState == STATE_CONNECTION_LOST ||
-      currentState == STATE_NO_AP_FOUND) {
+  void updateSoftAPClients() {
+    unsigned long now = millis();
+    ClientEvent event;
 
-      unsigned long currentTime = millis();
-      if (currentTime - lastWifiAttempt >= WIFI_RETRY_DELAY) {
-        setupWiFi();
-        lastWifiAttempt = currentTime;
+    while (clientEvents != nullptr && xQueueReceive(clientEvents, & event, 0) == pdTRUE) {
+      switch (event.type) {
+      case CLIENT_JOINED:
+        if (apClients.insert(event.mac, now) == nullptr) {
+          if (onErrorCallback) onErrorCallback("SoftAP client table full");
+        }
+        clientRefreshDue = true;
+        break;
+      case CLIENT_LEFT:
+        apClients.remove(event.mac);
+        break;
+      case CLIENT_TRAFFIC:
+        apClients.modifyByIP(event.ip, [ & ](SoftAPClient & client) {
+          client.bytesServed += event.bytes;
+          client.queriesServed += event.queries;
+          client.lastActivity = now;
+        });
+        break;
       }
     }
 
-    if (currentState == STATE_WAITING_FOR_IP) {
-      if (WiFi.localIP() != IPAddress(0, 0, 0, 0)) {
-        currentState = STATE_CONNECTED;
-        if (onConnectedCallback) onConnectedCallback();
-      }
-    }
+    if (!clientRefreshDue && now - lastClientRefresh < CLIENT_REFRESH_INTERVAL) return;
+    clientRefreshDue = false;
+    lastClientRefresh = now;
+
+    refreshSoftAPClients(now);
+    evictIdleClients(now);
   }
 
-  void updateSoftAP() {
-    if (isSoftAPActive) {
-      dnsServer.processNextRequest();
+  // Pull RSSI and DHCP leases from the driver's station list
+  void refreshSoftAPClients(unsigned long now) {
+    wifi_sta_list_t wifiList;
+    esp_netif_sta_list_t netifList;
+
+    if (esp_wifi_ap_get_sta_list( & wifiList) != ESP_OK) return;
+    if (esp_netif_get_sta_list( & wifiList, & netifList) != ESP_OK) return;
+
+    for (int i = 0; i < wifiList.num; i++) {
+      const uint8_t * mac = wifiList.sta[i].mac;
+      int8_t rssi = wifiList.sta[i].rssi;
+      uint32_t ip = netifList.sta[i].ip.addr;
+
+      apClients.insert(mac, now); // Stations that joined before tracking started
+      apClients.modify(mac, [ & ](SoftAPClient & client) {
+        // A changed RSSI means the driver heard a frame from the station
+        if (client.rssi != rssi || client.ipAddress != ip) client.lastActivity = now;
+        client.rssi = rssi;
+        client.ipAddress = ip;
+      });
+    }
+
+    // The driver list is authoritative: drop stations whose CLIENT_LEFT was
+    // lost to a full event queue
+    uint8_t gone[SoftAPClientTable::CAPACITY][6];
+    int goneCount = 0;
+    apClients.forEach([ & ](const SoftAPClient & client) {
+      for (int i = 0; i < wifiList.num; i++) {
+        if (memcmp(wifiList.sta[i].mac, client.mac, 6) == 0) return;
+      }
+      memcpy(gone[goneCount++], client.mac, 6);
+    });
+    for (int i = 0; i < goneCount; i++) {
+      apClients.remove(gone[i]);
     }
   }
 
-  void updateEthernetWithBackup() {
-    static bool isUsingWiFi = false; // Tracks if the backup WiFi is currently active
+  void evictIdleClients(unsigned long now) {
+    if (evictionPolicy == EVICT_NEVER) return;
+    if (evictionPolicy == EVICT_IDLE_WHEN_FULL && apClients.size() < apConfig.maxConnections) return;
+
+    const SoftAPClient * oldest = nullptr;
+    uint8_t evict[SoftAPClientTable::CAPACITY][6];
+    int evictCount = 0;
+
+    apClients.forEach([ & ](const SoftAPClient & client) {
+      if (now - client.lastActivity < clientIdleTimeout) return;
+      if (evictionPolicy == EVICT_IDLE) {
+        memcpy(evict[evictCount++], client.mac, 6);
+      } else if (oldest == nullptr || client.lastActivity < oldest -> lastActivity) {
+        oldest = & client;
+      }
+    });
+
+    if (oldest != nullptr) {
+      memcpy(evict[evictCount++], oldest -> mac, 6);
+    }
+
+    for (int i = 0; i < evictCount; i++) {
+      uint16_t aid;
+      if (esp_wifi_ap_get_sta_aid(evict[i], & aid) == ESP_OK) {
+        Serial.printf("Evicting idle SoftAP client %02X:%02X:%02X:%02X:%02X:%02X\n",
+          evict[i][0], evict[i][1], evict[i][2], evict[i][3], evict[i][4], evict[i][5]);
+        esp_wifi_deauth_sta(aid);
+      }
+      apClients.remove(evict[i]);
+    }
+  }
+
+  // The radio has one channel, so once the station associates the driver moves
+  // the SoftAP to the uplink's channel itself. Restarting the AP here would drop
+  // its clients, so only note where it ended up; apConfig.channel is left as
+  // configured for the next startSoftAP().
+  void trackSoftAPChannel() {
+    uint8_t channel = WiFi.channel();
+    if (!isSoftAPActive || channel == 0 || channel == softAPChannel) return;
+
+    Serial.printf("SoftAP followed uplink from channel %d to %d\n", softAPChannel, channel);
+    softAPChannel = channel;
+  }
+
+  // Advance to the next configured credential; returns true when the list wrapped
+  bool nextStationCredential() {
+    for (int i = 1; i <= NetworkConfig::MAX_WIFI_CREDENTIALS; i++) {
+      int index = (stationCredentialIndex + i) % NetworkConfig::MAX_WIFI_CREDENTIALS;
+      if (wifiConfig.credentials[index].ssid[0] != '\0') {
+        bool wrapped = index <= stationCredentialIndex;
+        stationCredentialIndex = index;
+        return wrapped;
+      }
+    }
+    return true;
+  }
+
+  void stationAttemptFailed() {
+    stationPhase = STATION_IDLE;
+    if (nextStationCredential()) {
+      lastWifiAttempt = millis(); // Back off once every credential has been tried
+    }
+  }
+
+  // Targeted scan for the current credential, to learn its channel and BSSID
+  void startStationLocate() {
+    if (wifiConfig.credentials[stationCredentialIndex].ssid[0] == '\0') {
+      nextStationCredential();
+    }
+
+    ScanConfig locate;
+    strncpy(locate.ssid, wifiConfig.credentials[stationCredentialIndex].ssid, 32);
+    locate.ssid[32] = '\0';
+    locate.maxDwellMs = STATION_LOCATE_DWELL;
+
+    if (startAsyncScan(locate)) {
+      stationPhase = STATION_LOCATING;
+      setState(STATE_SCANNING);
+    }
+  }
+
+  // Strongest BSSID, preferring one on the SoftAP channel so the AP does not have to move
+  const WiFiNetwork * pickStationTarget(const ScanResult & result) {
+    const WiFiNetwork * best = nullptr;
+    const WiFiNetwork * sameChannel = nullptr;
+
+    for (int i = 0; i < result.count; i++) {
+      const WiFiNetwork & network = result.networks[i];
+      if (best == nullptr || network.rssi > best -> rssi) best = & network;
+      if (network.channel == softAPChannel && (sameChannel == nullptr || network.rssi > sameChannel -> rssi)) {
+        sameChannel = & network;
+      }
+    }
+
+    if (sameChannel != nullptr && sameChannel -> rssi >= best -> rssi - 10) {
+      return sameChannel;
+    }
+    return best;
+  }
+
+  void connectStation(const WiFiNetwork & target) {
+    NetworkConfig::WiFiCredential & credential = wifiConfig.credentials[stationCredentialIndex];
+
+    if (!wifiConfig.isDhcp) {
+      WiFi.config(wifiConfig.ip, wifiConfig.gateway, wifiConfig.subnet, wifiConfig.dns);
+    }
+
+    // Pinning channel and BSSID skips the driver's own full-channel scan
+    trace.instant(TraceRecorder::TRACK_EVENTS, "connectStation", target.channel);
+    WiFi.begin(credential.ssid, credential.password, target.channel, target.bssid);
+    counters.wifiAttempts++;
+    stationAttemptStart = millis();
+    stationPhase = STATION_ASSOCIATING;
+    setState(STATE_CONNECTING);
+  }
+
+  void updateStation() {
+    if (!hasValidWiFiConfig()) return;
+
+    switch (stationPhase) {
+    case STATION_LOCATING: {
+      ScanResult result;
+      if (!getAsyncScanResult(result)) return;
+
+      const WiFiNetwork * target = pickStationTarget(result);
+      if (target == nullptr) {
+        setState(STATE_NO_AP_FOUND);
+        if (onErrorCallback) onErrorCallback("No AP found");
+        stationAttemptFailed();
+        return;
+      }
+
+      connectStation( * target);
+      break;
+    }
+    case STATION_ASSOCIATING:
+      if (currentState == STATE_CONNECTED) {
+        stationPhase = STATION_IDLE;
+        trackSoftAPChannel();
+      } else if (currentState == STATE_WRONG_PASSWORD || currentState == STATE_NO_AP_FOUND ||
+        currentState == STATE_CONNECTION_LOST || currentState == STATE_DISCONNECTED ||
+        millis() - stationAttemptStart >= STATION_CONNECT_TIMEOUT) {
+        WiFi.disconnect(false); // Keep the radio, and with it the SoftAP, running
+        if (currentState == STATE_CONNECTING || currentState == STATE_WAITING_FOR_IP) {
+          setState(STATE_DISCONNECTED);
+        }
+        stationAttemptFailed();
+      }
+      break;
+    case STATION_IDLE:
+      if (currentState == STATE_CONNECTED || updateInProgress) return;
+      if (millis() - lastWifiAttempt >= WIFI_RETRY_DELAY) {
+        startStationLocate();
+      }
+      break;
+    }
+  }
+
+  void updateEthernet() {
+    if (currentState == STATE_CONNECTED) {
+      if (Ethernet.linkStatus() != LinkON) {
+        setState(STATE_DISCONNECTED);
+        if (onDisconnectedCallback) onDisconnectedCallback();
+        //                fallbackToWiFi();
+      } else if (ethConfig.isDhcp) {
+        // Check if we still have a valid IP
+        IPAddress currentIP = Ethernet.localIP();
+        if (currentIP == IPAddress(0, 0, 0, 0)) {
+          if (onErrorCallback) onErrorCallback("Lost DHCP lease");
+          //                    fallbackToWiFi();
+        }
+      }
+    }
+  }
+
+  void updateWiFi() {
+    if (currentState == STATE_DISCONNECTED ||
+      currentState == STATE_CONNECTION_LOST ||
+      currentState == STATE_NO_AP_FOUND) {
+
+      unsigned long currentTime = millis();
+      if (currentTime - lastWifiAttempt >= WIFI_RETRY_DELAY && !updateInProgress) {
+        setupWiFi();
+        lastWifiAttempt = currentTime;
+      }
+    }
+
+    if (currentState == STATE_WAITING_FOR_IP) {
+      if (WiFi.localIP() != IPAddress(0, 0, 0, 0)) {
+        setState(STATE_CONNECTED);
+        if (onConnectedCallback) onConnectedCallback();
+      }
+    }
+  }
+
+  void updateSoftAP() {
+    if (isSoftAPActive) {
+      dnsServer.processNextRequest();
+      updateSoftAPClients();
+    }
+  }
+
+  void updateEthernetWithBackup() {
+    if (updateInProgress) return; // No interface switches during a firmware update
+
     static unsigned long lastEthernetCheck = 0;
     const unsigned long ethernetCheckInterval = 5000; // Check Ethernet status every 5 seconds
     const unsigned long wifiReconnectTimeout = 10000; // Max WiFi connection time (10 seconds)
@@ -608,12 +2370,13 @@ class NetworkManager {
 
     // Check Ethernet link status
     if (Ethernet.linkStatus() == LinkON) {
-      if (isUsingWiFi) {
+      if (isBackupActive) {
         Serial.println("Ethernet connection restored. Switching back to Ethernet...");
 
         // Disconnect WiFi if using it
         WiFi.disconnect();
-        isUsingWiFi = false;
+        isBackupActive = false;
+        trace.instant(TraceRecorder::TRACK_EVENTS, "failback", INTERFACE_ETHERNET);
         wifiReconnectAttempts = 0; // Reset WiFi retry attempts
         currentWiFiCredentialIndex = 0; // Reset to primary WiFi credentials
       }
@@ -621,27 +2384,32 @@ class NetworkManager {
       Serial.println("Using Ethernet connection.");
     } else {
       // Ethernet is disconnected
-      if (!isUsingWiFi) {
+      if (!isBackupActive) {
         Serial.println("Ethernet connection lost. Switching to WiFi...");
 
         // Attempt to connect to WiFi
         if (millis() - lastWiFiReconnectAttempt >= wifiReconnectTimeout && wifiReconnectAttempts < maxWiFiReconnectAttempts) {
           NetworkConfig::WiFiCredential & credential = wifiConfig.credentials[currentWiFiCredentialIndex];
           WiFi.begin(credential.ssid, credential.password);
+          counters.wifiAttempts++;
           lastWiFiReconnectAttempt = millis();
           wifiReconnectAttempts++;
 
           // Wait for WiFi connection with a timeout
           Serial.printf("Attempting to connect to WiFi: %s\n", credential.ssid);
           unsigned long startAttemptTime = millis();
+          trace.begin(TraceRecorder::TRACK_NETWORK, "waitForBackup", currentWiFiCredentialIndex);
           while (WiFi.status() != WL_CONNECTED && millis() - startAttemptTime < wifiReconnectTimeout) {
             delay(100); // Non-blocking, but wait to check connection status
             Serial.print(".");
           }
+          trace.end(TraceRecorder::TRACK_NETWORK, "waitForBackup");
 
           if (WiFi.status() == WL_CONNECTED) {
             Serial.println("\nWiFi connected successfully!");
-            isUsingWiFi = true;
+            isBackupActive = true;
+            counters.failovers++;
+            trace.instant(TraceRecorder::TRACK_EVENTS, "failover", INTERFACE_WIFI);
             wifiReconnectAttempts = 0; // Reset retry attempts on successful connection
           } else {
             Serial.println("\nFailed to connect to WiFi.");
@@ -651,7 +2419,7 @@ class NetworkManager {
       }
 
       // Handle regular WiFi operations here
-      if (isUsingWiFi) {
+      if (isBackupActive) {
         Serial.println("Using WiFi connection.");
       }
     }
@@ -666,3 +2434,1471 @@ class NetworkManager {
   }
 
 };
+
+// Streams a firmware image over HTTP from the active uplink into the inactive
+// OTA slot. Flash writes are double-buffered through a writer task, the image
+// is hashed as it is committed, and progress is saved in NVS so an interrupted
+// download resumes from the last committed offset, even across a reboot.
+class OtaUpdater {
+  public: enum OtaResult {
+    OTA_OK,
+    OTA_BAD_URL,
+    OTA_NO_UPLINK,
+    OTA_NO_PARTITION,
+    OTA_HTTP_ERROR,
+    OTA_IMAGE_TOO_LARGE,
+    OTA_FLASH_ERROR,
+    OTA_INTERRUPTED,
+    OTA_HASH_MISMATCH,
+    OTA_INVALID_IMAGE
+  };
+
+  struct Metrics {
+    uint32_t imageSize;
+    uint32_t resumedFrom; // Offset the download started at
+    uint32_t bytesDownloaded; // Bytes received in this run
+    uint32_t reconnects;
+    unsigned long downloadMs;
+    unsigned long verifyMs;
+    unsigned long totalMs; // From update() to reboot
+    uint32_t throughput; // Bytes per second while downloading
+  };
+
+  OtaUpdater(NetworkManager & manager): manager(manager),
+  partition(nullptr),
+  writerTask(nullptr),
+  writeJobs(nullptr),
+  writeResults(nullptr),
+  writePending(false),
+  committed(0),
+  imageSize(0),
+  lastSaved(0) {
+    memset( & metrics, 0, sizeof(metrics));
+  }
+
+  // url: http://host[:port]/path, sha256Hex: expected image hash (64 hex chars)
+  OtaResult update(const char * url, const char * sha256Hex, bool rebootWhenDone = true) {
+    unsigned long started = millis();
+    memset( & metrics, 0, sizeof(metrics));
+
+    char host[64];
+    char path[128];
+    uint16_t port;
+    if (!parseUrl(url, host, sizeof(host), port, path, sizeof(path)) || strlen(sha256Hex) != 64) {
+      return OTA_BAD_URL;
+    }
+
+    partition = esp_ota_get_next_update_partition(nullptr);
+    if (partition == nullptr) return OTA_NO_PARTITION;
+
+    manager.setUpdateInProgress(true);
+    OtaResult result = download(host, port, path, sha256Hex);
+    manager.setUpdateInProgress(false);
+
+    if (result != OTA_OK) {
+      Serial.printf("OTA failed (%d) at offset %u\n", result, committed);
+      return result;
+    }
+
+    clearProgress();
+    metrics.totalMs = millis() - started;
+    Serial.printf("OTA complete: %u bytes, %u B/s, %lu ms to reboot\n",
+      metrics.imageSize, metrics.throughput, metrics.totalMs);
+
+    if (rebootWhenDone) {
+      delay(100); // Let the serial output drain
+      esp_restart();
+    }
+    return OTA_OK;
+  }
+
+  const Metrics & getMetrics() {
+    return metrics;
+  }
+
+  private: static
+  const uint32_t CHUNK_SIZE = 4096; // One flash sector
+  static
+  const int MAX_RECONNECTS = 5;
+  static
+  const unsigned long READ_TIMEOUT = 10000;
+  static
+  const uint32_t SAVE_INTERVAL = 65536; // Persist progress every 64 KB
+
+  struct WriteJob {
+    const uint8_t * data;
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  NetworkManager & manager;
+  WiFiClient wifiClient;
+  EthernetClient ethernetClient;
+  const esp_partition_t * partition;
+  Metrics metrics;
+  mbedtls_sha256_context sha;
+  uint8_t buffers[2][CHUNK_SIZE];
+  TaskHandle_t writerTask;
+  QueueHandle_t writeJobs;
+  QueueHandle_t writeResults;
+  bool writePending;
+  uint32_t committed; // Bytes hashed and handed to flash; sector-aligned until the last chunk
+  uint32_t imageSize;
+  uint32_t lastSaved;
+
+  OtaResult download(const char * host, uint16_t port, const char * path, const char * sha256Hex) {
+    mbedtls_sha256_init( & sha);
+    mbedtls_sha256_starts_ret( & sha, 0);
+
+    committed = loadProgress(sha256Hex);
+    if (committed > 0 && !rehashCommitted()) {
+      committed = 0;
+      imageSize = 0;
+      mbedtls_sha256_starts_ret( & sha, 0);
+    }
+    metrics.resumedFrom = committed;
+    lastSaved = committed;
+
+    if (!startWriter()) {
+      mbedtls_sha256_free( & sha);
+      return OTA_FLASH_ERROR;
+    }
+
+    unsigned long downloadStart = millis();
+    OtaResult result = OTA_INTERRUPTED;
+
+    if (imageSize != 0 && committed >= imageSize) {
+      result = OTA_OK; // Fully written before an interruption, only verification is left
+    }
+
+    for (int attempt = 0; attempt <= MAX_RECONNECTS && result != OTA_OK; attempt++) {
+      if (attempt > 0) {
+        metrics.reconnects++;
+        Serial.printf("OTA resuming at offset %u\n", committed);
+        delay(1000);
+      }
+
+      result = fetch(host, port, path, sha256Hex);
+      if (result != OTA_INTERRUPTED) break;
+    }
+
+    stopWriter();
+    if (result != OTA_OK) saveProgress(sha256Hex);
+
+    metrics.downloadMs = millis() - downloadStart;
+    if (metrics.downloadMs > 0) {
+      metrics.throughput = (uint32_t)((uint64_t) metrics.bytesDownloaded * 1000 / metrics.downloadMs);
+    }
+
+    if (result == OTA_OK) {
+      unsigned long verifyStart = millis();
+      result = verify(sha256Hex);
+      metrics.verifyMs = millis() - verifyStart;
+    }
+
+    mbedtls_sha256_free( & sha);
+    return result;
+  }
+
+  // One HTTP request from the committed offset to the end of the image
+  OtaResult fetch(const char * host, uint16_t port, const char * path, const char * sha256Hex) {
+    Client * client = uplinkClient();
+    if (client == nullptr) return OTA_NO_UPLINK;
+
+    if (!client -> connect(host, port)) {
+      client -> stop();
+      return OTA_INTERRUPTED;
+    }
+
+    client -> printf("GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n", path, host);
+    if (committed > 0) client -> printf("Range: bytes=%u-\r\n", committed);
+    client -> print("\r\n");
+
+    uint32_t start = 0;
+    OtaResult result = readHeaders( * client, start);
+    if (result != OTA_OK) {
+      client -> stop();
+      return result;
+    }
+
+    if (start != committed) {
+      // The server ignored the range request or the image changed; start over
+      committed = 0;
+      lastSaved = 0;
+      mbedtls_sha256_starts_ret( & sha, 0);
+      if (start != 0) {
+        client -> stop();
+        return OTA_INTERRUPTED;
+      }
+    }
+
+    if (imageSize > partition -> size) {
+      client -> stop();
+      return OTA_IMAGE_TOO_LARGE;
+    }
+    metrics.imageSize = imageSize;
+
+    result = streamBody( * client, sha256Hex);
+    client -> stop();
+    return result;
+  }
+
+  OtaResult streamBody(Client & client, const char * sha256Hex) {
+    int active = 0;
+    uint32_t filled = 0;
+    uint32_t received = committed;
+    unsigned long lastData = millis();
+
+    while (received < imageSize) {
+      int available = client.available();
+      if (available <= 0) {
+        if (!client.connected() || millis() - lastData > READ_TIMEOUT) break;
+        delay(1);
+        continue;
+      }
+
+      uint32_t want = CHUNK_SIZE - filled;
+      if (want > imageSize - received) want = imageSize - received;
+      if (want > (uint32_t) available) want = available;
+
+      int got = client.read(buffers[active] + filled, want);
+      if (got <= 0) continue;
+
+      filled += got;
+      received += got;
+      metrics.bytesDownloaded += got;
+      lastData = millis();
+
+      if (filled == CHUNK_SIZE || received == imageSize) {
+        if (!submitChunk(buffers[active], filled, sha256Hex)) return OTA_FLASH_ERROR;
+        active ^= 1; // Keep receiving into the other buffer while this one is written
+        filled = 0;
+      }
+    }
+
+    // A partially filled buffer is dropped; it is fetched again on resume
+    if (!waitForWriter(sha256Hex)) return OTA_FLASH_ERROR;
+    return committed == imageSize ? OTA_OK : OTA_INTERRUPTED;
+  }
+
+  // Hash a chunk and hand it to the writer task once the previous one has landed
+  bool submitChunk(const uint8_t * data, uint32_t length, const char * sha256Hex) {
+    if (!waitForWriter(sha256Hex)) return false;
+
+    mbedtls_sha256_update_ret( & sha, data, length);
+
+    WriteJob job = {
+      data,
+      committed,
+      length
+    };
+    xQueueSend(writeJobs, & job, portMAX_DELAY);
+    writePending = true;
+    committed += length;
+    return true;
+  }
+
+  bool waitForWriter(const char * sha256Hex) {
+    if (!writePending) return true;
+
+    esp_err_t err;
+    xQueueReceive(writeResults, & err, portMAX_DELAY);
+    writePending = false;
+    if (err != ESP_OK) {
+      committed = lastSaved; // The failed chunk was already counted
+      return false;
+    }
+
+    if (committed - lastSaved >= SAVE_INTERVAL) {
+      saveProgress(sha256Hex);
+    }
+    return true;
+  }
+
+  static void writerLoop(void * arg) {
+    OtaUpdater * self = static_cast < OtaUpdater * > (arg);
+    WriteJob job;
+    esp_err_t err;
+
+    while (xQueueReceive(self -> writeJobs, & job, portMAX_DELAY) == pdTRUE && job.data != nullptr) {
+      uint32_t eraseLength = (job.length + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1);
+      err = esp_partition_erase_range(self -> partition, job.offset, eraseLength);
+      if (err == ESP_OK) err = esp_partition_write(self -> partition, job.offset, job.data, job.length);
+      xQueueSend(self -> writeResults, & err, portMAX_DELAY);
+    }
+
+    err = ESP_OK;
+    xQueueSend(self -> writeResults, & err, portMAX_DELAY); // Acknowledge the stop request
+    vTaskDelete(nullptr);
+  }
+
+  bool startWriter() {
+    writePending = false;
+    writeJobs = xQueueCreate(1, sizeof(WriteJob));
+    writeResults = xQueueCreate(1, sizeof(esp_err_t));
+    if (writeJobs == nullptr || writeResults == nullptr ||
+      xTaskCreate(writerLoop, "ota_writer", 4096, this, 5, & writerTask) != pdPASS) {
+      if (writeJobs != nullptr) vQueueDelete(writeJobs);
+      if (writeResults != nullptr) vQueueDelete(writeResults);
+      writeJobs = nullptr;
+      writeResults = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  void stopWriter() {
+    esp_err_t ack;
+    WriteJob stop = {
+      nullptr,
+      0,
+      0
+    };
+
+    if (writePending) xQueueReceive(writeResults, & ack, portMAX_DELAY);
+    xQueueSend(writeJobs, & stop, portMAX_DELAY);
+    xQueueReceive(writeResults, & ack, portMAX_DELAY);
+
+    vQueueDelete(writeJobs);
+    vQueueDelete(writeResults);
+    writeJobs = nullptr;
+    writeResults = nullptr;
+    writerTask = nullptr;
+    writePending = false;
+  }
+
+  OtaResult verify(const char * sha256Hex) {
+    uint8_t digest[32];
+    char hex[65];
+
+    mbedtls_sha256_finish_ret( & sha, digest);
+    for (int i = 0; i < 32; i++) {
+      snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+
+    if (strcasecmp(hex, sha256Hex) != 0) {
+      clearProgress(); // Do not resume into a bad image
+      return OTA_HASH_MISMATCH;
+    }
+
+    // Also runs the bootloader's image checks on the new slot
+    if (esp_ota_set_boot_partition(partition) != ESP_OK) {
+      clearProgress();
+      return OTA_INVALID_IMAGE;
+    }
+    return OTA_OK;
+  }
+
+  // Status line, Content-Length and Content-Range; start is the first byte served
+  OtaResult readHeaders(Client & client, uint32_t & start) {
+    char line[160];
+    int status = 0;
+    uint32_t contentLength = 0;
+    uint32_t total = 0;
+
+    if (!readLine(client, line, sizeof(line))) return OTA_INTERRUPTED;
+    if (sscanf(line, "HTTP/%*s %d", & status) != 1) return OTA_HTTP_ERROR;
+    if (status != 200 && status != 206) {
+      Serial.printf("OTA server returned HTTP %d\n", status);
+      return OTA_HTTP_ERROR;
+    }
+
+    start = 0;
+    while (readLine(client, line, sizeof(line)) && line[0] != '\0') {
+      if (strncasecmp(line, "Content-Length:", 15) == 0) {
+        contentLength = strtoul(line + 15, nullptr, 10);
+      } else if (strncasecmp(line, "Content-Range:", 14) == 0) {
+        // Content-Range: bytes <first>-<last>/<total>
+        unsigned long first, last, size;
+        if (sscanf(line + 14, " bytes %lu-%lu/%lu", & first, & last, & size) == 3) {
+          start = first;
+          total = size;
+        }
+      }
+    }
+
+    uint32_t size = status == 206 ? total : contentLength;
+    if (size == 0) return OTA_HTTP_ERROR;
+    if (imageSize != 0 && size != imageSize) {
+      Serial.println("OTA image size changed, restarting download");
+      imageSize = size;
+      start = UINT32_MAX; // Forces a restart from offset 0
+      return OTA_OK;
+    }
+    imageSize = size;
+    return OTA_OK;
+  }
+
+  bool readLine(Client & client, char * line, size_t size) {
+    size_t length = 0;
+    unsigned long lastData = millis();
+
+    while (millis() - lastData < READ_TIMEOUT) {
+      int c = client.read();
+      if (c < 0) {
+        if (!client.connected()) return false;
+        delay(1);
+        continue;
+      }
+      lastData = millis();
+      if (c == '\r') continue;
+      if (c == '\n') {
+        line[length] = '\0';
+        return true;
+      }
+      if (length < size - 1) line[length++] = (char) c;
+    }
+    return false;
+  }
+
+  Client * uplinkClient() {
+    switch (manager.getActiveInterface()) {
+    case NetworkManager::INTERFACE_ETHERNET:
+      return & ethernetClient;
+    case NetworkManager::INTERFACE_WIFI:
+      return & wifiClient;
+    default:
+      return nullptr;
+    }
+  }
+
+  static bool parseUrl(const char * url, char * host, size_t hostSize, uint16_t & port, char * path, size_t pathSize) {
+    if (strncmp(url, "http://", 7) != 0) return false;
+
+    const char * begin = url + 7;
+    const char * slash = strchr(begin, '/');
+    const char * end = slash != nullptr ? slash : begin + strlen(begin);
+    const char * colon = (const char * ) memchr(begin, ':', end - begin);
+    const char * hostEnd = colon != nullptr ? colon : end;
+
+    if (hostEnd == begin || (size_t)(hostEnd - begin) >= hostSize) return false;
+    memcpy(host, begin, hostEnd - begin);
+    host[hostEnd - begin] = '\0';
+
+    port = colon != nullptr ? (uint16_t) atoi(colon + 1) : 80;
+    snprintf(path, pathSize, "%s", slash != nullptr ? slash : "/");
+    return port != 0;
+  }
+
+  // Resume state kept in NVS; the expected hash identifies the image
+  uint32_t loadProgress(const char * sha256Hex) {
+    Preferences prefs;
+    char savedHash[65] = "";
+    uint32_t offset = 0;
+
+    imageSize = 0;
+    if (!prefs.begin("netmgr_ota", true)) return 0;
+
+    prefs.getString("sha256", savedHash, sizeof(savedHash));
+    if (strcasecmp(savedHash, sha256Hex) == 0 && prefs.getUInt("slot", 0) == partition -> address) {
+      offset = prefs.getUInt("offset", 0);
+      imageSize = prefs.getUInt("size", 0);
+    }
+    prefs.end();
+    return offset;
+  }
+
+  void saveProgress(const char * sha256Hex) {
+    Preferences prefs;
+    if (!prefs.begin("netmgr_ota", false)) return;
+
+    prefs.putString("sha256", sha256Hex);
+    prefs.putUInt("slot", partition -> address);
+    prefs.putUInt("size", imageSize);
+    prefs.putUInt("offset", committed);
+    prefs.end();
+    lastSaved = committed;
+  }
+
+  void clearProgress() {
+    Preferences prefs;
+    if (prefs.begin("netmgr_ota", false)) {
+      prefs.clear();
+      prefs.end();
+    }
+  }
+
+  // Rebuild the running hash from what is already in flash
+  bool rehashCommitted() {
+    for (uint32_t offset = 0; offset < committed; offset += CHUNK_SIZE) {
+      uint32_t length = committed - offset < CHUNK_SIZE ? committed - offset : CHUNK_SIZE;
+      if (esp_partition_read(partition, offset, buffers[0], length) != ESP_OK) return false;
+      mbedtls_sha256_update_ret( & sha, buffers[0], length);
+    }
+    return true;
+  }
+};
+
+// TCP client that routes over whichever uplink NetworkManager reports as
+// active. When the interface changes it reconnects to the same host and port
+// on the new one; writes made in the meantime are held in a send queue built
+// from the manager's buffer pool. Data already handed to the old socket but
+// not yet acknowledged by the peer can still be lost.
+class NetClient: public Client {
+  public: NetClient(NetworkManager & manager, size_t sendQueueLimit = 2048): manager(manager),
+  queue(manager.getBufferPool()),
+  route(nullptr),
+  generation(manager.getInterfaceGeneration()),
+  port(0),
+  wantConnected(false),
+  queueLimit(sendQueueLimit),
+  reconnectDeadline(0),
+  lastReconnect(0),
+  reconnectCount(0) {
+    host[0] = '\0';
+  }
+
+  int connect(IPAddress ip, uint16_t port) override {
+    host[0] = '\0';
+    remoteIP = ip;
+    return start(port);
+  }
+
+  int connect(const char * host, uint16_t port) override {
+    strncpy(this -> host, host, sizeof(this -> host) - 1);
+    this -> host[sizeof(this -> host) - 1] = '\0';
+    return start(port);
+  }
+
+  size_t write(uint8_t b) override {
+    return write( & b, 1);
+  }
+
+  size_t write(const uint8_t * data, size_t size) override {
+    if (!wantConnected) return 0;
+
+    checkRoute();
+    flushQueue();
+
+    size_t sent = 0;
+    if (queue.size() == 0 && routeUp()) {
+      sent = route -> write(data, size);
+      if (sent < size) beginReconnect(); // The socket broke underneath us
+    }
+    if (sent < size) {
+      sent += queue.push(data + sent, size - sent, queueLimit);
+    }
+    return sent;
+  }
+
+  int available() override {
+    checkRoute();
+    flushQueue();
+    return routeUp() ? route -> available() : 0;
+  }
+
+  int read() override {
+    return routeUp() ? route -> read() : -1;
+  }
+
+  int read(uint8_t * buffer, size_t size) override {
+    return routeUp() ? route -> read(buffer, size) : -1;
+  }
+
+  int peek() override {
+    return routeUp() ? route -> peek() : -1;
+  }
+
+  void flush() override {
+    checkRoute();
+    flushQueue();
+    if (routeUp()) route -> flush();
+  }
+
+  void stop() override {
+    wantConnected = false;
+    reconnectDeadline = 0;
+    queue.clear();
+    if (route != nullptr) route -> stop();
+  }
+
+  // Stays true while a failover reconnect is pending
+  uint8_t connected() override {
+    checkRoute();
+    return routeUp() || reconnectDeadline != 0;
+  }
+
+  operator bool() override {
+    return connected();
+  }
+
+  void setSendQueueLimit(size_t bytes) {
+    queueLimit = bytes;
+  }
+
+  size_t queuedBytes() {
+    return queue.size();
+  }
+
+  uint32_t getReconnectCount() {
+    return reconnectCount;
+  }
+
+  private: static
+  const unsigned long RECONNECT_INTERVAL = 1000;
+  static
+  const unsigned long RECONNECT_WINDOW = 30000; // Give up and drop the queue after this
+
+  NetworkManager & manager;
+  WiFiClient wifiClient;
+  EthernetClient ethernetClient;
+  BlockQueue queue;
+  Client * route;
+  uint32_t generation;
+  char host[64];
+  IPAddress remoteIP;
+  uint16_t port;
+  bool wantConnected;
+  size_t queueLimit;
+  unsigned long reconnectDeadline;
+  unsigned long lastReconnect;
+  uint32_t reconnectCount;
+
+  Client * pickRoute() {
+    switch (manager.getActiveInterface()) {
+    case NetworkManager::INTERFACE_ETHERNET:
+      return & ethernetClient;
+    case NetworkManager::INTERFACE_WIFI:
+    case NetworkManager::INTERFACE_SOFTAP:
+      return & wifiClient;
+    default:
+      return nullptr;
+    }
+  }
+
+  int start(uint16_t port) {
+    this -> port = port;
+    wantConnected = true;
+    reconnectDeadline = 0;
+    generation = manager.getInterfaceGeneration();
+    if (route != nullptr) route -> stop();
+
+    if (open()) return 1;
+    wantConnected = false;
+    return 0;
+  }
+
+  bool open() {
+    route = pickRoute();
+    if (route == nullptr) return false;
+
+    int ok = host[0] != '\0' ? route -> connect(host, port) : route -> connect(remoteIP, port);
+    return ok > 0;
+  }
+
+  bool routeUp() {
+    return route != nullptr && reconnectDeadline == 0 && route -> connected();
+  }
+
+  void beginReconnect() {
+    if (reconnectDeadline != 0) return;
+    reconnectDeadline = millis() + RECONNECT_WINDOW;
+    lastReconnect = millis() - RECONNECT_INTERVAL; // Try right away
+  }
+
+  void checkRoute() {
+    uint32_t current = manager.getInterfaceGeneration();
+    if (current != generation) {
+      generation = current;
+      if (route != nullptr) route -> stop();
+      route = nullptr;
+      if (wantConnected) beginReconnect();
+    }
+
+    if (reconnectDeadline == 0 || millis() - lastReconnect < RECONNECT_INTERVAL) return;
+    lastReconnect = millis();
+
+    if (route != nullptr) route -> stop();
+    if (open()) {
+      reconnectDeadline = 0;
+      reconnectCount++;
+    } else if ((long)(millis() - reconnectDeadline) > 0) {
+      // The uplink did not come back in time
+      reconnectDeadline = 0;
+      wantConnected = false;
+      queue.clear();
+    }
+  }
+
+  void flushQueue() {
+    while (queue.size() > 0 && routeUp()) {
+      size_t length;
+      const uint8_t * data = queue.front(length);
+      size_t sent = route -> write(data, length);
+      if (sent == 0) {
+        beginReconnect();
+        return;
+      }
+      queue.consume(sent);
+    }
+  }
+};
+
+// UDP socket that follows the active uplink. The local port is rebound on
+// the new interface after a failover; packets sent while no interface is
+// available are queued (with their destination) and sent once one is.
+class NetUDP: public UDP {
+  public: NetUDP(NetworkManager & manager, size_t sendQueueLimit = 2048): manager(manager),
+  packet(manager.getBufferPool()),
+  pending(manager.getBufferPool()),
+  route(nullptr),
+  generation(manager.getInterfaceGeneration()),
+  localPort(0),
+  bound(false),
+  packetPort(0),
+  queueLimit(sendQueueLimit) {}
+
+  uint8_t begin(uint16_t port) override {
+    localPort = port;
+    bound = true;
+    generation = manager.getInterfaceGeneration();
+    return bindRoute();
+  }
+
+  void stop() override {
+    bound = false;
+    packet.clear();
+    pending.clear();
+    if (route != nullptr) route -> stop();
+    route = nullptr;
+  }
+
+  int beginPacket(IPAddress ip, uint16_t port) override {
+    packet.clear();
+    packetIP = ip;
+    packetPort = port;
+    return 1;
+  }
+
+  int beginPacket(const char * host, uint16_t port) override {
+    IPAddress ip;
+    if (!ip.fromString(host)) return 0; // Resolve names before sending
+    return beginPacket(ip, port);
+  }
+
+  size_t write(uint8_t b) override {
+    return write( & b, 1);
+  }
+
+  size_t write(const uint8_t * data, size_t size) override {
+    return packet.push(data, size, queueLimit);
+  }
+
+  int endPacket() override {
+    checkRoute();
+    flushPending();
+
+    if (pending.size() == 0 && route != nullptr) {
+      return sendPacket(packetIP, packetPort, packet);
+    }
+
+    // No interface right now: queue the packet behind a small header
+    uint8_t header[8];
+    uint32_t address = (uint32_t) packetIP;
+    uint16_t length = packet.size();
+    memcpy(header, & address, 4);
+    memcpy(header + 4, & packetPort, 2);
+    memcpy(header + 6, & length, 2);
+
+    if (pending.size() + sizeof(header) + length > queueLimit) {
+      packet.clear();
+      return 0;
+    }
+
+    // The pool is shared, so a record can still come up short: roll it back
+    // rather than leave a header without its payload
+    size_t queued = pending.size();
+    bool complete = pending.pushAll(header, sizeof(header), queueLimit);
+    while (complete && packet.size() > 0) {
+      size_t chunk;
+      const uint8_t * data = packet.front(chunk);
+      complete = pending.pushAll(data, chunk, queueLimit);
+      packet.consume(chunk); // Frees the block just copied
+    }
+
+    if (!complete) {
+      pending.trim(pending.size() - queued);
+      packet.clear();
+      return 0;
+    }
+    return 1;
+  }
+
+  int parsePacket() override {
+    checkRoute();
+    flushPending();
+    return route != nullptr ? route -> parsePacket() : 0;
+  }
+
+  int available() override {
+    return route != nullptr ? route -> available() : 0;
+  }
+
+  int read() override {
+    return route != nullptr ? route -> read() : -1;
+  }
+
+  int read(unsigned char * buffer, size_t len) override {
+    return route != nullptr ? route -> read(buffer, len) : -1;
+  }
+
+  int read(char * buffer, size_t len) override {
+    return read((unsigned char * ) buffer, len);
+  }
+
+  int peek() override {
+    return route != nullptr ? route -> peek() : -1;
+  }
+
+  void flush() override {
+    if (route != nullptr) route -> flush();
+  }
+
+  IPAddress remoteIP() override {
+    return route != nullptr ? route -> remoteIP() : IPAddress(0, 0, 0, 0);
+  }
+
+  uint16_t remotePort() override {
+    return route != nullptr ? route -> remotePort() : 0;
+  }
+
+  size_t queuedBytes() {
+    return pending.size();
+  }
+
+  private: NetworkManager & manager;
+  WiFiUDP wifiUdp;
+  EthernetUDP ethernetUdp;
+  BlockQueue packet; // Packet being built
+  BlockQueue pending; // Packets waiting for an interface
+  UDP * route;
+  uint32_t generation;
+  uint16_t localPort;
+  bool bound;
+  IPAddress packetIP;
+  uint16_t packetPort;
+  size_t queueLimit;
+
+  UDP * pickRoute() {
+    switch (manager.getActiveInterface()) {
+    case NetworkManager::INTERFACE_ETHERNET:
+      return & ethernetUdp;
+    case NetworkManager::INTERFACE_WIFI:
+    case NetworkManager::INTERFACE_SOFTAP:
+      return & wifiUdp;
+    default:
+      return nullptr;
+    }
+  }
+
+  uint8_t bindRoute() {
+    if (route != nullptr) route -> stop();
+    route = pickRoute();
+    if (route == nullptr) return 0;
+    return route -> begin(localPort);
+  }
+
+  void checkRoute() {
+    uint32_t current = manager.getInterfaceGeneration();
+    if (current == generation && (route != nullptr || !bound)) return;
+
+    generation = current;
+    if (bound) bindRoute();
+  }
+
+  int sendPacket(const IPAddress & ip, uint16_t port, BlockQueue & source) {
+    if (!route -> beginPacket(ip, port)) {
+      source.clear();
+      return 0;
+    }
+    while (source.size() > 0) {
+      size_t chunk;
+      const uint8_t * data = source.front(chunk);
+      route -> write(data, chunk);
+      source.consume(chunk);
+    }
+    return route -> endPacket();
+  }
+
+  void flushPending() {
+    while (pending.size() > 0 && route != nullptr) {
+      uint8_t header[8];
+      uint32_t address;
+      uint16_t port, length;
+
+      if (pending.pop(header, sizeof(header)) < sizeof(header)) {
+        pending.clear();
+        break;
+      }
+      memcpy( & address, header, 4);
+      memcpy( & port, header + 4, 2);
+      memcpy( & length, header + 6, 2);
+      if (length > pending.size()) {
+        pending.clear(); // Framing lost; nothing after this can be trusted
+        break;
+      }
+
+      if (!route -> beginPacket(IPAddress(address), port)) {
+        pending.consume(length);
+        continue;
+      }
+      while (length > 0) {
+        size_t chunk;
+        const uint8_t * data = pending.front(chunk);
+        if (data == nullptr) break;
+        if (chunk > length) chunk = length;
+        route -> write(data, chunk);
+        pending.consume(chunk);
+        length -= chunk;
+      }
+      route -> endPacket();
+    }
+  }
+};
+
+// Caching DNS resolver on top of NetUDP. Each miss is sent to every DNS server
+// of the active interface (plus any added with addServer()) at once and the
+// first usable answer wins. Answers are cached for their TTL, NXDOMAIN/NODATA
+// for the SOA negative TTL (RFC 2308), and cached names are re-resolved in the
+// background after a failover and shortly before popular entries expire.
+class DnsResolver {
+  public: static
+  const int CACHE_SIZE = NETMANAGER_DNS_CACHE_SIZE;
+  static
+  const int MAX_EXTRA_SERVERS = 2;
+  static
+  const size_t MAX_NAME = 64;
+
+  enum DnsResult {
+    DNS_OK,
+    DNS_NOT_FOUND, // NXDOMAIN or no A record, possibly served from cache
+    DNS_BAD_NAME,
+    DNS_NO_SERVER,
+    DNS_TIMEOUT,
+    DNS_SERVER_FAILURE // Every server answered SERVFAIL/REFUSED
+  };
+
+  struct Stats {
+    uint32_t lookups;
+    uint32_t hits; // Answered from cache
+    uint32_t negativeHits; // Answered from cache with a cached failure
+    uint32_t misses; // Sent to the network
+    uint32_t timeouts;
+    uint32_t refreshes; // Background re-resolutions
+    uint32_t totalLatencyMs; // Summed over misses
+    uint32_t maxLatencyMs;
+    IPAddress lastWinner; // Server that answered the last miss first
+  };
+
+  DnsResolver(NetworkManager & manager): manager(manager),
+  udp(manager, 512),
+  generation(manager.getInterfaceGeneration()),
+  extraCount(0),
+  negativeTtl(60),
+  lastRefresh(0),
+  started(false) {
+    memset(cache, 0, sizeof(cache));
+    lookup = Query();
+    refresh = Query();
+    stats = Stats();
+  }
+
+  // Query this server alongside the interface's own, e.g. a stand-in on port 5353
+  bool addServer(const IPAddress & ip, uint16_t port = 53) {
+    if (extraCount >= MAX_EXTRA_SERVERS) return false;
+    extraServers[extraCount].ip = ip;
+    extraServers[extraCount].port = port;
+    extraCount++;
+    return true;
+  }
+
+  void clearServers() {
+    extraCount = 0;
+  }
+
+  DnsResult resolve(const char * host, IPAddress & result, unsigned long timeoutMs = 2000) {
+    if (result.fromString(host)) return DNS_OK;
+
+    char name[MAX_NAME];
+    if (!normalizeName(host, name)) return DNS_BAD_NAME;
+
+    unsigned long begun = millis();
+    stats.lookups++;
+
+    Entry * entry = find(name);
+    if (entry != nullptr) {
+      entry -> uses++;
+      entry -> lastUsed = begun;
+      if (entry -> negative) {
+        stats.negativeHits++;
+        return DNS_NOT_FOUND;
+      }
+      stats.hits++;
+      result = IPAddress(entry -> address);
+      return DNS_OK;
+    }
+
+    stats.misses++;
+    if (!startQuery(lookup, name)) return DNS_NO_SERVER;
+
+    // Retransmit once halfway through in case the first datagrams were lost
+    bool retried = false;
+    while (lookup.outcome == PENDING) {
+      unsigned long elapsed = millis() - begun;
+      if (elapsed >= timeoutMs) break;
+      if (!retried && elapsed >= timeoutMs / 2) {
+        retried = true;
+        sendQuery(lookup);
+      }
+      poll();
+      delay(1);
+    }
+
+    uint32_t latency = millis() - begun;
+    stats.totalLatencyMs += latency;
+    if (latency > stats.maxLatencyMs) stats.maxLatencyMs = latency;
+
+    Outcome outcome = lookup.outcome;
+    lookup.active = false;
+
+    switch (outcome) {
+    case ANSWERED:
+      result = IPAddress(lookup.address);
+      return DNS_OK;
+    case NEGATIVE:
+      return DNS_NOT_FOUND;
+    case FAILED:
+      return DNS_SERVER_FAILURE;
+    default:
+      stats.timeouts++;
+      return DNS_TIMEOUT;
+    }
+  }
+
+  // Same contract as WiFi.hostByName(): 1 on success
+  int hostByName(const char * host, IPAddress & result) {
+    return resolve(host, result) == DNS_OK ? 1 : 0;
+  }
+
+  // Call from loop(); sends at most one background refresh per call and never blocks
+  void update() {
+    if (!started) return;
+
+    uint32_t current = manager.getInterfaceGeneration();
+    if (current != generation) {
+      generation = current;
+      // New uplink: re-resolve everything still valid through its servers so
+      // lookups right after the failover hit a warm cache on both ends
+      for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cache[i].used && !cache[i].negative && !expired(cache[i])) cache[i].refresh = true;
+      }
+      refresh.active = false;
+    }
+
+    poll();
+    if (refresh.active && millis() - refresh.sentAt >= REFRESH_TIMEOUT) refresh.active = false;
+    if (refresh.active || manager.getActiveInterface() == NetworkManager::INTERFACE_NONE) return;
+    if (millis() - lastRefresh < REFRESH_INTERVAL) return;
+
+    Entry * due = nullptr;
+    for (int i = 0; i < CACHE_SIZE && due == nullptr; i++) {
+      Entry & entry = cache[i];
+      if (!entry.used || entry.negative || expired(entry)) continue;
+
+      // Prefetch popular names during the last eighth of their TTL
+      if (entry.uses >= PREFETCH_USES && remaining(entry) < entry.ttlMs / 8) entry.refresh = true;
+      if (entry.refresh) due = & entry;
+    }
+    if (due == nullptr) return;
+
+    due -> refresh = false;
+    due -> uses = 0; // A failed prefetch is not retried until the name is used again
+    lastRefresh = millis();
+    if (startQuery(refresh, due -> name)) stats.refreshes++;
+  }
+
+  void flush() {
+    memset(cache, 0, sizeof(cache));
+  }
+
+  // Used for negative answers that carry no SOA record
+  void setNegativeTtl(uint32_t seconds) {
+    negativeTtl = seconds;
+  }
+
+  const Stats & getStats() {
+    return stats;
+  }
+
+  // Share of lookups answered from cache, 0.0 - 1.0
+  float getHitRate() {
+    if (stats.lookups == 0) return 0.0f;
+    return (float)(stats.hits + stats.negativeHits) / stats.lookups;
+  }
+
+  // Mean time to resolve a miss, in milliseconds
+  uint32_t getAverageLatency() {
+    return stats.misses > 0 ? stats.totalLatencyMs / stats.misses : 0;
+  }
+
+  private: static
+  const int MAX_SERVERS = MAX_EXTRA_SERVERS + 3;
+  static
+  const uint32_t MAX_TTL = 86400; // Seconds; keeps TTLs well inside millis()
+  static
+  const uint16_t PREFETCH_USES = 3;
+  static
+  const unsigned long REFRESH_INTERVAL = 250;
+  static
+  const unsigned long REFRESH_TIMEOUT = 2000;
+  static
+  const size_t MAX_PACKET = 512;
+
+  enum Outcome {
+    PENDING,
+    ANSWERED,
+    NEGATIVE,
+    FAILED
+  };
+
+  struct Server {
+    IPAddress ip;
+    uint16_t port;
+  };
+
+  struct Entry {
+    char name[MAX_NAME];
+    uint32_t hash;
+    uint32_t address;
+    unsigned long storedAt;
+    unsigned long lastUsed;
+    uint32_t ttlMs;
+    uint16_t uses; // Lookups since the entry was stored or refreshed
+    bool used;
+    bool negative;
+    bool refresh; // Re-resolve on a later update()
+  };
+
+  struct Query {
+    bool active;
+    uint16_t id;
+    char name[MAX_NAME];
+    unsigned long sentAt;
+    uint8_t failures; // Servers that answered SERVFAIL/REFUSED
+    Outcome outcome;
+    uint32_t address;
+    Server servers[MAX_SERVERS]; // Raced by this query; answers from others are ignored
+    int serverCount;
+  };
+
+  NetworkManager & manager;
+  NetUDP udp;
+  uint32_t generation;
+  Server extraServers[MAX_EXTRA_SERVERS];
+  int extraCount;
+  Entry cache[CACHE_SIZE];
+  Query lookup; // Foreground resolve()
+  Query refresh; // Background update()
+  Stats stats;
+  uint32_t negativeTtl;
+  unsigned long lastRefresh;
+  bool started;
+
+  static uint32_t hashName(const char * name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    while ( * name) {
+      hash ^= (uint8_t) * name++;
+      hash *= 16777619u;
+    }
+    return hash;
+  }
+
+  // Lowercase, strip a trailing dot and check label lengths
+  static bool normalizeName(const char * host, char * name) {
+    size_t length = strlen(host);
+    if (length > 0 && host[length - 1] == '.') length--;
+    if (length == 0 || length >= MAX_NAME) return false;
+
+    size_t label = 0;
+    for (size_t i = 0; i < length; i++) {
+      char c = host[i];
+      if (c == '.') {
+        if (label == 0) return false;
+        label = 0;
+      } else if (++label > 63) {
+        return false;
+      }
+      name[i] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+    name[length] = '\0';
+    return label > 0;
+  }
+
+  static bool expired(const Entry & entry) {
+    return millis() - entry.storedAt >= entry.ttlMs;
+  }
+
+  static uint32_t remaining(const Entry & entry) {
+    uint32_t age = millis() - entry.storedAt;
+    return age < entry.ttlMs ? entry.ttlMs - age : 0;
+  }
+
+  Entry * find(const char * name) {
+    uint32_t hash = hashName(name);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+      Entry & entry = cache[i];
+      if (entry.used && entry.hash == hash && strcmp(entry.name, name) == 0) {
+        return expired(entry) ? nullptr : & entry;
+      }
+    }
+    return nullptr;
+  }
+
+  void store(const char * name, uint32_t address, uint32_t ttl, bool negative) {
+    uint32_t hash = hashName(name);
+    Entry * slot = nullptr;
+    Entry * empty = nullptr;
+    Entry * oldest = nullptr;
+
+    // Same name, else a free or expired slot, else the least recently used
+    for (int i = 0; i < CACHE_SIZE && slot == nullptr; i++) {
+      Entry & entry = cache[i];
+      if (entry.used && entry.hash == hash && strcmp(entry.name, name) == 0) {
+        slot = & entry;
+      } else if (!entry.used || expired(entry)) {
+        if (empty == nullptr) empty = & entry;
+      } else if (oldest == nullptr || (long)(entry.lastUsed - oldest -> lastUsed) < 0) {
+        oldest = & entry;
+      }
+    }
+    if (slot == nullptr) slot = empty != nullptr ? empty : oldest;
+
+    bool known = slot -> used && slot -> hash == hash;
+    strcpy(slot -> name, name);
+    slot -> hash = hash;
+    slot -> address = address;
+    slot -> storedAt = millis();
+    slot -> ttlMs = (ttl > MAX_TTL ? MAX_TTL : ttl) * 1000;
+    slot -> negative = negative;
+    slot -> refresh = false;
+    slot -> uses = 0;
+    if (!known) slot -> lastUsed = slot -> storedAt;
+    slot -> used = true;
+  }
+
+  int collectServers(Query & query) {
+    query.serverCount = 0;
+    for (int i = 0; i < extraCount; i++) query.servers[query.serverCount++] = extraServers[i];
+
+    IPAddress dhcp[3];
+    int found = manager.getDnsServers(dhcp, 3);
+    for (int i = 0; i < found; i++) {
+      query.servers[query.serverCount].ip = dhcp[i];
+      query.servers[query.serverCount].port = 53;
+      query.serverCount++;
+    }
+    return query.serverCount;
+  }
+
+  static bool fromServer(const Query & query, const IPAddress & ip, uint16_t port) {
+    for (int i = 0; i < query.serverCount; i++) {
+      if (query.servers[i].ip == ip && query.servers[i].port == port) return true;
+    }
+    return false;
+  }
+
+  bool startQuery(Query & query, const char * name) {
+    if (manager.getActiveInterface() == NetworkManager::INTERFACE_NONE) return false;
+    if (collectServers(query) == 0) return false;
+
+    if (!started) {
+      udp.begin(49152 + esp_random() % 16384);
+      started = true;
+    }
+
+    query.active = true;
+    query.id = esp_random() & 0xFFFF;
+    strcpy(query.name, name);
+    query.failures = 0;
+    query.outcome = PENDING;
+    query.address = 0;
+    return sendQuery(query);
+  }
+
+  // The same datagram goes to every server; the first usable answer wins
+  bool sendQuery(Query & query) {
+    uint8_t packet[12 + MAX_NAME + 1 + 4];
+    size_t length = buildQuery(packet, query.id, query.name);
+
+    int sent = 0;
+    for (int i = 0; i < query.serverCount; i++) {
+      if (!udp.beginPacket(query.servers[i].ip, query.servers[i].port)) continue;
+      udp.write(packet, length);
+      sent += udp.endPacket();
+    }
+    query.sentAt = millis();
+    return sent > 0;
+  }
+
+  static size_t buildQuery(uint8_t * packet, uint16_t id, const char * name) {
+    memset(packet, 0, 12);
+    packet[0] = id >> 8;
+    packet[1] = id & 0xFF;
+    packet[2] = 0x01; // Recursion desired
+    packet[5] = 1; // One question
+
+    size_t pos = 12;
+    while ( * name) {
+      const char * dot = strchr(name, '.');
+      size_t label = dot != nullptr ? dot - name : strlen(name);
+      packet[pos++] = label;
+      memcpy(packet + pos, name, label);
+      pos += label;
+      name += label;
+      if ( * name == '.') name++;
+    }
+    packet[pos++] = 0;
+    packet[pos++] = 0;
+    packet[pos++] = 1; // QTYPE A
+    packet[pos++] = 0;
+    packet[pos++] = 1; // QCLASS IN
+    return pos;
+  }
+
+  void poll() {
+    uint8_t packet[MAX_PACKET];
+
+    while (udp.parsePacket() > 0) {
+      IPAddress from = udp.remoteIP();
+      uint16_t port = udp.remotePort();
+      int length = udp.read(packet, sizeof(packet));
+      if (length <= 0) continue;
+
+      if (lookup.active && lookup.outcome == PENDING && fromServer(lookup, from, port) &&
+        handleResponse(lookup, packet, length)) {
+        stats.lastWinner = from;
+      } else if (refresh.active && fromServer(refresh, from, port)) {
+        handleResponse(refresh, packet, length);
+      }
+    }
+  }
+
+  // Returns true once the query has an outcome
+  bool handleResponse(Query & query, const uint8_t * packet, size_t length) {
+    uint32_t address, ttl;
+    int rcode = parseResponse(packet, length, query.id, query.name, address, ttl);
+    if (rcode < 0) return false;
+
+    if (rcode == 0 && address != 0) {
+      store(query.name, address, ttl, false);
+      query.outcome = ANSWERED;
+      query.address = address;
+    } else if (rcode == 0 || rcode == 3) {
+      store(query.name, 0, ttl == UINT32_MAX ? negativeTtl : ttl, true);
+      query.outcome = NEGATIVE;
+    } else {
+      // SERVFAIL/REFUSED: keep waiting for the other servers
+      if (++query.failures < query.serverCount) return false;
+      query.outcome = FAILED;
+    }
+
+    if ( & query == & refresh) query.active = false;
+    return true;
+  }
+
+  // Returns the RCODE, or -1 if the packet does not answer this query. address
+  // is the first A record (0 if none); ttl is the answer TTL, or for negative
+  // answers the SOA negative TTL (UINT32_MAX if there was no SOA)
+  static int parseResponse(const uint8_t * packet, size_t length, uint16_t id, const char * name, uint32_t & address, uint32_t & ttl) {
+    if (length < 12) return -1;
+    if (((packet[0] << 8) | packet[1]) != id || !(packet[2] & 0x80)) return -1;
+    if (((packet[4] << 8) | packet[5]) != 1) return -1;
+
+    int rcode = packet[3] & 0x0F;
+    uint16_t answers = (packet[6] << 8) | packet[7];
+    uint16_t authority = (packet[8] << 8) | packet[9];
+
+    size_t pos = 12;
+    char question[MAX_NAME];
+    if (!readName(packet, length, pos, question) || strcasecmp(question, name) != 0) return -1;
+    pos += 4;
+    if (pos > length) return -1;
+
+    address = 0;
+    uint32_t answerTtl = UINT32_MAX;
+    uint32_t soaTtl = UINT32_MAX;
+
+    for (uint16_t i = 0; i < answers + authority; i++) {
+      if (!skipName(packet, length, pos) || pos + 10 > length) return -1;
+      uint16_t type = (packet[pos] << 8) | packet[pos + 1];
+      uint16_t rclass = (packet[pos + 2] << 8) | packet[pos + 3];
+      uint32_t recordTtl = ((uint32_t) packet[pos + 4] << 24) | ((uint32_t) packet[pos + 5] << 16) |
+        ((uint32_t) packet[pos + 6] << 8) | packet[pos + 7];
+      uint16_t dataLength = (packet[pos + 8] << 8) | packet[pos + 9];
+      pos += 10;
+      if (pos + dataLength > length) return -1;
+
+      if (i < answers) {
+        // The CNAMEs leading to the address bound its lifetime too
+        if (rclass == 1 && ((type == 1 && dataLength == 4) || type == 5) && address == 0) {
+          if (recordTtl < answerTtl) answerTtl = recordTtl;
+          if (type == 1) memcpy( & address, packet + pos, 4);
+        }
+      } else if (type == 6 && dataLength >= 22) {
+        // Negative TTL is min(SOA TTL, SOA MINIMUM)
+        const uint8_t * minimum = packet + pos + dataLength - 4;
+        uint32_t soaMinimum = ((uint32_t) minimum[0] << 24) | ((uint32_t) minimum[1] << 16) |
+          ((uint32_t) minimum[2] << 8) | minimum[3];
+        soaTtl = recordTtl < soaMinimum ? recordTtl : soaMinimum;
+      }
+      pos += dataLength;
+    }
+
+    ttl = address != 0 ? answerTtl : soaTtl;
+    return rcode;
+  }
+
+  // Decode a possibly compressed name into name (MAX_NAME bytes); pos moves past it
+  static bool readName(const uint8_t * packet, size_t length, size_t & pos, char * name) {
+    size_t cursor = pos;
+    size_t out = 0;
+    bool jumped = false;
+    int hops = 0;
+
+    while (cursor < length) {
+      uint8_t label = packet[cursor];
+
+      if ((label & 0xC0) == 0xC0) {
+        if (cursor + 1 >= length || ++hops > 16) return false;
+        if (!jumped) pos = cursor + 2;
+        jumped = true;
+        cursor = ((label & 0x3F) << 8) | packet[cursor + 1];
+        continue;
+      }
+      if (label == 0) {
+        if (!jumped) pos = cursor + 1;
+        name[out] = '\0';
+        return true;
+      }
+      if (cursor + 1 + label > length || out + label + 1 >= MAX_NAME) return false;
+      if (out > 0) name[out++] = '.';
+      memcpy(name + out, packet + cursor + 1, label);
+      out += label;
+      cursor += 1 + label;
+    }
+    return false;
+  }
+
+  static bool skipName(const uint8_t * packet, size_t length, size_t & pos) {
+    while (pos < length) {
+      uint8_t label = packet[pos];
+      if ((label & 0xC0) == 0xC0) {
+        pos += 2;
+        return pos <= length;
+      }
+      pos += 1 + label;
+      if (label == 0) return pos <= length;
+    }
+    return false;
+  }
+};
@@ -29,20 +29,20 @@ void onDHCPTimeout() {
 }
 
 void onClientConnected(WiFiEvent_t event, WiFiEventInfo_t info) {
-  if (event == SYSTEM_EVENT_AP_STACONNECTED) {
+  if (event == ARDUINO_EVENT_WIFI_AP_STACONNECTED) {
     // Station connected to SoftAP
     Serial.printf("New client connected to AP - MAC: %02X:%02X:%02X:%02X:%02X:%02X\n",
-      info.wifi_sta_connected.bssid[0], info.wifi_sta_connected.bssid[1], info.wifi_sta_connected.bssid[2],
-      info.wifi_sta_connected.bssid[3], info.wifi_sta_connected.bssid[4], info.wifi_sta_connected.bssid[5]);
+      info.wifi_ap_staconnected.mac[0], info.wifi_ap_staconnected.mac[1], info.wifi_ap_staconnected.mac[2],
+      info.wifi_ap_staconnected.mac[3], info.wifi_ap_staconnected.mac[4], info.wifi_ap_staconnected.mac[5]);
   }
 }
 
 void onClientDisconnected(WiFiEvent_t event, WiFiEventInfo_t info) {
-  if (event == SYSTEM_EVENT_AP_STADISCONNECTED) {
+  if (event == ARDUINO_EVENT_WIFI_AP_STADISCONNECTED) {
     // Station disconnected from SoftAP
     Serial.printf("Client disconnected from AP - MAC: %02X:%02X:%02X:%02X:%02X:%02X\n",
-      info.wifi_sta_disconnected.bssid[0], info.wifi_sta_disconnected.bssid[1], info.wifi_sta_disconnected.bssid[2],
-      info.wifi_sta_disconnected.bssid[3], info.wifi_sta_disconnected.bssid[4], info.wifi_sta_disconnected.bssid[5]);
+      info.wifi_ap_stadisconnected.mac[0], info.wifi_ap_stadisconnected.mac[1], info.wifi_ap_stadisconnected.mac[2],
+      info.wifi_ap_stadisconnected.mac[3], info.wifi_ap_stadisconnected.mac[4], info.wifi_ap_stadisconnected.mac[5]);
   }
 }
 
@@ -124,6 +124,101 @@ void testWiFiScan(NetworkManager & network) {
   }
 }
 
+// Measure how long a status snapshot takes to serialize and how much of the
+// fixed JSON arena it needs
+void benchmarkStatusJson(NetworkManager & network) {
+  static char buffer[1024];
+  const int iterations = 100;
+  size_t length = 0;
+
+  unsigned long start = micros();
+  for (int i = 0; i < iterations; i++) {
+    length = network.writeStatusJson(buffer, sizeof(buffer));
+  }
+  unsigned long elapsed = micros() - start;
+
+  Serial.printf("Status JSON: %u bytes, %lu us per snapshot, %u bytes peak arena\n",
+    (unsigned) length, elapsed / iterations, (unsigned) network.getStatusJsonPeakMemory());
+  Serial.println(buffer);
+}
+
+#ifdef BENCH_HOST
+// Build with -DBENCH_HOST=\"<host>\" and run a sink such as `nc -lk 9000 > /dev/null`
+// to compare NetClient with the raw client of the active interface
+template < typename C >
+  void measureThroughput(C & client, const char * label) {
+    static uint8_t payload[1024];
+    const size_t total = 256 * 1024;
+
+    if (!client.connect(BENCH_HOST, 9000)) {
+      Serial.printf("%s: connect failed\n", label);
+      return;
+    }
+
+    size_t sent = 0;
+    unsigned long start = millis();
+    while (sent < total) {
+      size_t written = client.write(payload, sizeof(payload));
+      if (written == 0) break;
+      sent += written;
+    }
+    client.flush();
+    unsigned long elapsed = millis() - start;
+    client.stop();
+
+    Serial.printf("%s: %u bytes in %lu ms (%lu KB/s)\n", label, (unsigned) sent, elapsed,
+      elapsed > 0 ? (unsigned long) sent * 1000 / elapsed / 1024 : 0);
+  }
+
+void benchmarkTransport(NetworkManager & network) {
+  static NetClient netClient(network);
+
+  if (network.getActiveInterface() == NetworkManager::INTERFACE_ETHERNET) {
+    static EthernetClient raw;
+    measureThroughput(raw, "EthernetClient");
+  } else {
+    static WiFiClient raw;
+    measureThroughput(raw, "WiFiClient");
+  }
+  measureThroughput(netClient, "NetClient");
+}
+#endif
+
+#ifdef OTA_URL
+// Build with -DOTA_URL=\"http://<host>:8080/firmware.bin\" -DOTA_SHA256=\"<hash>\"
+// and run ota_server.py to update once the network is up
+void runOtaUpdate(NetworkManager & network) {
+  static OtaUpdater ota(network);
+
+  OtaUpdater::OtaResult result = ota.update(OTA_URL, OTA_SHA256);
+  const OtaUpdater::Metrics & metrics = ota.getMetrics();
+  Serial.printf("OTA result %d: %u bytes from offset %u, %u B/s, %u reconnects\n",
+    result, metrics.bytesDownloaded, metrics.resumedFrom, metrics.throughput, metrics.reconnects);
+}
+#endif
+
+#ifdef DNS_STANDIN
+// Build with -DDNS_STANDIN=\"<host ip>\" and run dns_standin.py on that host
+// to watch the cache hit rate and miss latency, including across failovers
+void testDnsCache(DnsResolver & dns) {
+  static const char * names[] = {
+    "alpha.test",
+    "beta.test",
+    "missing.test"
+  };
+
+  for (const char * name: names) {
+    IPAddress address;
+    DnsResolver::DnsResult result = dns.resolve(name, address);
+    Serial.printf("DNS %s: %d %s\n", name, result, address.toString().c_str());
+  }
+
+  const DnsResolver::Stats & stats = dns.getStats();
+  Serial.printf("DNS cache: %u lookups, %.0f%% hits, %u ms average miss, %u ms worst, %u refreshes\n",
+    stats.lookups, dns.getHitRate() * 100, dns.getAverageLatency(), stats.maxLatencyMs, stats.refreshes);
+}
+#endif
+
 void loop() {
   static NetworkManager network;
   static bool initialized = false;
@@ -133,40 +228,57 @@ void loop() {
   static const unsigned long SCAN_INTERVAL = 30000; // 30 seconds
 
   if (!initialized) {
-    // Configure Primary WiFi settings
-    NetworkConfig wifiConfig;
-    strcpy(wifiConfig.credentials[0].ssid, "test1");
-    strcpy(wifiConfig.credentials[0].password, "dsahkahsdkasdhas");
-    wifiConfig.isDhcp = true;
-    wifiConfig.credentials[0].authMode = WIFI_AUTH_WPA2_PSK;
-
-    // Configure Backup WiFi settings
-    NetworkConfig backupWiFiConfig;
-    strcpy(wifiConfig.credentials[1].ssid, "test2");
-    strcpy(wifiConfig.credentials[1].password, "sakdaksjdhaskhdsakdhkasjhd");
-    wifiConfig.credentials[1].authMode = WIFI_AUTH_WPA2_PSK;
-
-    // Configure ethernet settings if needed
-    NetworkConfig ethConfig;
-    ethConfig.isDhcp = true;
-
-    byte newMac[6] = {
-      0x00,
-      0x1A,
-      0x2B,
-      0x3C,
-      0x4D,
-      0x5E
-    };
-    if (network.setEthMacAddress(newMac)) {
-      Serial.println("MAC address updated successfully.");
+    // Factory provisioning image from the "prov" partition, if one was flashed;
+    // otherwise configure from code. Both paths are timed for comparison, each
+    // from nothing to MAC, WiFi and Ethernet configs in place. Serial is drained
+    // first so the MAC log line below goes to the UART FIFO without blocking.
+    Serial.flush();
+    unsigned long configStart = micros();
+    if (network.loadProvisioning()) {
+      unsigned long configTime = micros() - configStart;
+      Serial.printf("Configured from provisioning image %s in %lu us\n",
+        network.getProvisioning() -> serial, configTime);
     } else {
-      Serial.println("Failed to update MAC address.");
-    }
+      // Configure Primary WiFi settings
+      NetworkConfig wifiConfig;
+      strcpy(wifiConfig.credentials[0].ssid, "test1");
+      strcpy(wifiConfig.credentials[0].password, "dsahkahsdkasdhas");
+      wifiConfig.isDhcp = true;
+      wifiConfig.credentials[0].authMode = WIFI_AUTH_WPA2_PSK;
+
+      // Configure Backup WiFi settings
+      NetworkConfig backupWiFiConfig;
+      strcpy(wifiConfig.credentials[1].ssid, "test2");
+      strcpy(wifiConfig.credentials[1].password, "sakdaksjdhaskhdsakdhkasjhd");
+      wifiConfig.credentials[1].authMode = WIFI_AUTH_WPA2_PSK;
+
+      // Configure ethernet settings if needed
+      NetworkConfig ethConfig;
+      ethConfig.isDhcp = true;
 
-    // Set configurations
-    network.setWiFiConfig(wifiConfig); 
-    network.setEthernetConfig(ethConfig);
+      byte newMac[6] = {
+        0x00,
+        0x1A,
+        0x2B,
+        0x3C,
+        0x4D,
+        0x5E
+      };
+
+      bool macUpdated = network.setEthMacAddress(newMac);
+
+      // Set configurations
+      network.setWiFiConfig(wifiConfig); 
+      network.setEthernetConfig(ethConfig);
+      unsigned long configTime = micros() - configStart;
+
+      if (macUpdated) {
+        Serial.println("MAC address updated successfully.");
+      } else {
+        Serial.println("Failed to update MAC address.");
+      }
+      Serial.printf("Configured from code in %lu us\n", configTime);
+    }
 
     // Set callbacks
     network.setCallbacks(
@@ -184,6 +296,7 @@ void loop() {
     //    MODE_WIFI                     - WiFi only
     //    MODE_ETHERNET_WIFI_BACKUP     - Ethernet with WiFi backup
     //    MODE_WIFI_AP                  - Soft AP mode
+    //    MODE_WIFI_AP_STA              - Soft AP with WiFi connecting in the background
     network.begin(NetworkManager::MODE_WIFI);
     initialized = true;
   }
@@ -191,6 +304,49 @@ void loop() {
   // Regular updates
   network.update();
 
+#ifdef BENCH_HOST
+  static bool benchmarked = false;
+  if (!benchmarked && network.isConnected()) {
+    benchmarked = true;
+    benchmarkTransport(network);
+  }
+#endif
+
+#ifdef DNS_STANDIN
+  static DnsResolver dns(network);
+  static unsigned long lastDnsTest = 0;
+  static bool dnsConfigured = false;
+  if (!dnsConfigured) {
+    IPAddress standin;
+    standin.fromString(DNS_STANDIN);
+    dns.addServer(standin, 5353);
+    dnsConfigured = true;
+  }
+  dns.update();
+  if (network.isConnected() && millis() - lastDnsTest >= STATUS_INTERVAL) {
+    testDnsCache(dns);
+    lastDnsTest = millis();
+  }
+#endif
+
+#ifdef TRACE_BOOT
+  // Build with -DTRACE_BOOT and save the JSON line printed after the first
+  // connect to a .json file to view the boot timeline in ui.perfetto.dev
+  static bool traced = false;
+  if (!traced && network.isConnected()) {
+    traced = true;
+    network.getTrace().writeChromeTrace(Serial);
+  }
+#endif
+
+#ifdef OTA_URL
+  static bool otaAttempted = false;
+  if (!otaAttempted && network.isConnected()) {
+    otaAttempted = true;
+    runOtaUpdate(network);
+  }
+#endif
+
   // Print status periodically
   if (millis() - lastStatusPrint >= STATUS_INTERVAL) {
     printNetworkInfo(network);
@@ -201,5 +357,12 @@ void loop() {
   if (millis() - lastScan >= SCAN_INTERVAL) {
     testWiFiScan(network);
     lastScan = millis();
+
+    // Benchmark a full snapshot: connected, with scan results to report
+    static bool statusBenchmarked = false;
+    if (!statusBenchmarked && network.isConnected()) {
+      statusBenchmarked = true;
+      benchmarkStatusJson(network);
+    }
   }
 }
\ No newline at end of file